@@ -0,0 +1,310 @@
+#include "../src/uci.h"
+#include <cmath>
+#include <fstream>
+
+// Offline checks and conversions for net files (make nettool).
+//
+//   nettool verify <net>
+//       Parses the net exactly as the engine does and reports its layout,
+//       weight ranges, and anything suspicious: weights pinned at the int16
+//       limits (clipped by quantization), non-finite floats in hidden
+//       layers, and trailing bytes.
+//
+//   nettool headroom <net> [epd file]
+//       Builds the accumulators of a position corpus in int32 and reports
+//       how close they come to the int16 range the kernels use. The corpus
+//       is the bench positions and all their children unless a file of
+//       FENs is given. Also prints a static bound that ignores legality.
+//
+//   nettool quantize <float checkpoint> <out> [template net]
+//       Quantizes a float32 checkpoint with the engine's QA/QB. The
+//       checkpoint holds the same arrays as a single layer net, in the same
+//       order, as floats. Its bucket layout is taken from the template net
+//       (one king bucket and one output bucket without one), and the output
+//       is a versioned net.
+//
+// There is no repacking command: every kernel tier uses the feature
+// transformer in its natural [bucket][feature][neuron] order, so nets are
+// mapped and used as they are stored.
+
+struct LoadedNet {
+  Network net;
+  size_t size;
+  NetHeader header;
+  bool versioned;
+};
+
+bool load(const std::string &path, LoadedNet &loaded) {
+  if (!load_net(PhaseTypes::Middlegame, path)) {
+    return false;
+  }
+  loaded.net = g_nets[PhaseTypes::Middlegame];
+  loaded.size = g_net_files[PhaseTypes::Middlegame].mapping->size();
+
+  const auto *bytes = static_cast<const char *>(
+      g_net_files[PhaseTypes::Middlegame].mapping->data());
+  std::memset(&loaded.header, 0, sizeof(loaded.header));
+  std::memcpy(&loaded.header, bytes,
+              std::min(loaded.size, sizeof(loaded.header)));
+  loaded.versioned = loaded.header.magic == NET_MAGIC;
+  return true;
+}
+
+struct Range {
+  int64_t min = INT64_MAX, max = INT64_MIN;
+  uint64_t pinned = 0; // values at the int16 limits
+
+  void add(int64_t value) {
+    min = std::min(min, value), max = std::max(max, value);
+    pinned += value == INT16_MIN || value == INT16_MAX;
+  }
+};
+
+void print_range(const char *name, const int16_t *values, size_t count) {
+  Range range;
+  for (size_t i = 0; i < count; i++) {
+    range.add(values[i]);
+  }
+  printf("  %-16s %9zu values in [%" PRIi64 ", %" PRIi64 "]", name, count,
+         range.min, range.max);
+  if (range.pinned) {
+    printf(", %" PRIu64 " at the int16 limits (clipped?)", range.pinned);
+  }
+  printf("\n");
+}
+
+int verify(const std::string &path) {
+  LoadedNet loaded;
+  if (!load(path, loaded)) {
+    return 1;
+  }
+  const Network &net = loaded.net;
+
+  printf("%s: %zu bytes, %s\n", path.c_str(), loaded.size,
+         loaded.versioned ? "versioned" : "legacy");
+  if (loaded.versioned) {
+    printf("  version %u, %u king bucket(s)%s, %u output bucket(s)%s\n",
+           loaded.header.version, net.input_buckets,
+           net.mirrored ? " mirrored" : "", net.output_buckets,
+           net.layers ? ", hidden layers" : "");
+  }
+
+  const size_t header_size =
+      loaded.versioned ? net_header_size(loaded.header.version) : 0;
+  const size_t expected =
+      header_size + net_data_size(net.input_buckets, net.output_buckets,
+                                  net.layers != nullptr);
+  // Padding up to the next 64 bytes is expected.
+  if (loaded.size > (expected + 63) / 64 * 64) {
+    printf("  %zu trailing bytes after the weights\n", loaded.size - expected);
+  }
+
+  print_range("feature weights", net.feature_v,
+              net.input_buckets * INPUT_SIZE * LAYER1_SIZE);
+  print_range("feature bias", net.feature_bias->data(), LAYER1_SIZE);
+
+  if (!net.layers) {
+    print_range("output weights", net.output_v[0].data(),
+                LAYER1_SIZE * 2 * net.output_buckets);
+    print_range("output bias", net.output_bias, net.output_buckets);
+    return 0;
+  }
+
+  int bad_floats = 0;
+  for (int bucket = 0; bucket < net.output_buckets; bucket++) {
+    const LayerStack &layers = net.layers[bucket];
+    auto check = [&](const float *values, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        bad_floats += !std::isfinite(values[i]);
+      }
+    };
+    check(layers.l2_weights.data(), layers.l2_weights.size());
+    check(layers.l2_bias.data(), layers.l2_bias.size());
+    check(layers.output_weights.data(), layers.output_weights.size());
+    check(&layers.output_bias, 1);
+  }
+  printf("  hidden layers    %d non-finite float(s)\n", bad_floats);
+  return bad_floats ? 1 : 0;
+}
+
+int headroom(const std::string &path, const std::string &corpus_path) {
+  LoadedNet loaded;
+  if (!load(path, loaded)) {
+    return 1;
+  }
+  const Network &net = loaded.net;
+
+  std::vector<Position> positions;
+  if (corpus_path.empty()) {
+    ThreadInfo &thread_info = *std::make_unique<ThreadInfo>();
+    for (const NNUEBenchRoot &root : nnuebench_corpus(bench_fens, thread_info)) {
+      positions.push_back(root.position);
+      for (const auto *moves : {&root.quiets, &root.captures, &root.castles}) {
+        for (const NNUEBenchMove &entry : *moves) {
+          positions.push_back(entry.moved_position);
+        }
+      }
+    }
+  } else {
+    std::ifstream in(corpus_path);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty()) {
+        set_board_pieces(positions.emplace_back(), line);
+      }
+    }
+  }
+
+  // Accumulate in int32 so that overflow shows up instead of wrapping.
+  Range range;
+  std::array<int32_t, LAYER1_SIZE> acc;
+
+  for (const Position &position : positions) {
+    for (int perspective : {Colors::White, Colors::Black}) {
+      const PerspectiveRows rows = net.perspective_rows(
+          perspective,
+          king_square(position.colors_bb, position.pieces_bb, perspective));
+
+      for (size_t i = 0; i < LAYER1_SIZE; i++) {
+        acc[i] = (*net.feature_bias)[i];
+      }
+      for (int color : {Colors::White, Colors::Black}) {
+        for (int type = PieceTypes::Pawn; type <= PieceTypes::King; type++) {
+          for (uint64_t bb = position.colors_bb[color] &
+                             position.pieces_bb[type];
+               bb;) {
+            const int16_t *row = rows.row(type * 2 + color, pop_lsb(bb));
+            for (size_t i = 0; i < LAYER1_SIZE; i++) {
+              acc[i] += row[i];
+            }
+          }
+        }
+      }
+      for (int32_t value : acc) {
+        range.add(value);
+      }
+    }
+  }
+
+  const int64_t peak = std::max(-range.min, range.max);
+  printf("%zu positions: accumulators in [%" PRIi64 ", %" PRIi64
+         "], %.2f bits of headroom below int16\n",
+         positions.size(), range.min, range.max,
+         std::log2(double(INT16_MAX) / std::max<int64_t>(peak, 1)));
+
+  // Any 32 features, one per board square at most in practice: per neuron,
+  // the bias plus its 32 largest (or smallest) weights.
+  int64_t bound = 0;
+  const size_t num_rows = net.input_buckets * INPUT_SIZE;
+  std::vector<int16_t> column(num_rows);
+  for (size_t i = 0; i < LAYER1_SIZE; i++) {
+    for (size_t row = 0; row < num_rows; row++) {
+      column[row] = net.feature_v[row * LAYER1_SIZE + i];
+    }
+    std::sort(column.begin(), column.end());
+
+    int64_t high = (*net.feature_bias)[i], low = (*net.feature_bias)[i];
+    for (size_t n = 0; n < 32; n++) {
+      high += std::max<int64_t>(column[num_rows - 1 - n], 0);
+      low += std::min<int64_t>(column[n], 0);
+    }
+    bound = std::max({bound, high, -low});
+  }
+  printf("static bound (any 32 features): %" PRIi64 " (%s int16)\n", bound,
+         bound > INT16_MAX ? "exceeds" : "within");
+
+  return peak > INT16_MAX ? 1 : 0;
+}
+
+int quantize(const std::string &float_path, const std::string &out_path,
+             const std::string &template_path) {
+  NetHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = NET_MAGIC;
+  header.version = NET_VERSION;
+  header.input_size = INPUT_SIZE;
+  header.hidden_size = LAYER1_SIZE;
+  header.output_buckets = 1;
+  header.input_buckets = 1;
+
+  if (!template_path.empty()) {
+    LoadedNet loaded;
+    if (!load(template_path, loaded)) {
+      return 1;
+    }
+    if (loaded.net.layers) {
+      printf("Layered nets can't be quantized here; their hidden layers are "
+             "quantized by the trainer\n");
+      return 1;
+    }
+    header.output_buckets = loaded.net.output_buckets;
+    header.input_buckets = loaded.net.input_buckets;
+    header.flags = loaded.net.mirrored ? NetFlags::Mirrored : 0;
+    header.king_buckets = loaded.net.king_buckets;
+  }
+
+  const size_t ft_count = header.input_buckets * INPUT_SIZE * LAYER1_SIZE;
+  const size_t out_count = header.output_buckets * LAYER1_SIZE * 2;
+  const size_t count = ft_count + LAYER1_SIZE + out_count + header.output_buckets;
+
+  std::ifstream in(float_path, std::ios::binary | std::ios::ate);
+  if (!in || size_t(in.tellg()) != count * sizeof(float)) {
+    printf("%s should hold %zu floats (%u king bucket(s), %u output "
+           "bucket(s))\n",
+           float_path.c_str(), count, header.input_buckets,
+           header.output_buckets);
+    return 1;
+  }
+  std::vector<float> values(count);
+  in.seekg(0);
+  in.read(reinterpret_cast<char *>(values.data()), count * sizeof(float));
+
+  // Feature weights and bias are scaled by QA, output weights by QB, and the
+  // output bias by QA * QB, matching evaluate_accumulator.
+  std::vector<int16_t> quantized(count);
+  uint64_t clipped = 0;
+  for (size_t i = 0; i < count; i++) {
+    const double scale = i < ft_count + LAYER1_SIZE           ? QA
+                         : i < ft_count + LAYER1_SIZE + out_count ? QB
+                                                                  : QAB;
+    const long value = std::lround(values[i] * scale);
+    quantized[i] = std::clamp<long>(value, INT16_MIN, INT16_MAX);
+    clipped += quantized[i] != value;
+  }
+
+  std::ofstream out(out_path, std::ios::binary);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(quantized.data()),
+            count * sizeof(int16_t));
+
+  // Pad so the file size stays a multiple of 64, like the trainer's output.
+  const size_t written = sizeof(header) + count * sizeof(int16_t);
+  const std::vector<char> padding((64 - written % 64) % 64, 0);
+  out.write(padding.data(), padding.size());
+  out.close();
+
+  printf("Wrote %s: %zu weights, %" PRIu64 " clipped to int16\n",
+         out_path.c_str(), count, clipped);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  init_bbs();
+
+  const std::string command = argc > 1 ? argv[1] : "";
+
+  if (command == "verify" && argc > 2) {
+    return verify(argv[2]);
+  }
+  if (command == "headroom" && argc > 2) {
+    return headroom(argv[2], argc > 3 ? argv[3] : "");
+  }
+  if (command == "quantize" && argc > 3) {
+    return quantize(argv[2], argv[3], argc > 4 ? argv[4] : "");
+  }
+
+  printf("usage: nettool verify <net>\n"
+         "       nettool headroom <net> [epd file]\n"
+         "       nettool quantize <float checkpoint> <out> [template net]\n");
+  return 1;
+}
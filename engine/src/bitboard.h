@@ -1,10 +1,16 @@
 #pragma once
+#include "cpu.h"
 #include "defs.h"
 #include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string_view>
+
+#if defined(USE_DISPATCH) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 enum Square : int { // a1 = 0. a8 = 7, etc. thus a1 is the LSB and h8 is the
                     // MSB.
@@ -240,6 +246,38 @@ uint64_t rook_sliders(int square, uint64_t occ) {
   return bb;
 }
 
+// On BMI2 hosts the slider tables are indexed with pext instead of magic
+// multiplication. A dispatch build decides which at startup, so the tables
+// have to be filled with the same indexing that the lookups use.
+
+#if defined(USE_DISPATCH)
+__attribute__((target("bmi2"))) inline uint64_t pext(uint64_t bb,
+                                                     uint64_t mask) {
+  return _pext_u64(bb, mask);
+}
+inline bool use_pext() { return g_cpu_level >= CpuLevels::AVX2_BMI2; }
+#elif defined(__BMI2__)
+inline uint64_t pext(uint64_t bb, uint64_t mask) { return _pext_u64(bb, mask); }
+constexpr bool use_pext() { return true; }
+#else
+inline uint64_t pext(uint64_t, uint64_t) { return 0; }
+constexpr bool use_pext() { return false; }
+#endif
+
+inline uint64_t bishop_index(int sq, uint64_t occ) {
+  if (use_pext()) {
+    return pext(occ, BishopMasks[sq]);
+  }
+  return (occ & BishopMasks[sq]) * BishopMagics[sq] >> 55;
+}
+
+inline uint64_t rook_index(int sq, uint64_t occ) {
+  if (use_pext()) {
+    return pext(occ, RookMasks[sq]);
+  }
+  return (occ & RookMasks[sq]) * RookMagics[sq] >> 52;
+}
+
 void fill_bishop_attacks() {
   for (int square = a1; square < SqNone; square++) {
     int bits = pop_count(BishopMasks[square]);
@@ -247,7 +285,7 @@ void fill_bishop_attacks() {
     for (int i = 0; i < occ_var; i++) {
       uint64_t occ = set_occ(i, bits, BishopMasks[square]);
 
-      uint64_t magic_idx = occ * BishopMagics[square] >> 55;
+      uint64_t magic_idx = bishop_index(square, occ);
       BishopAttacks[square][magic_idx] = bishop_sliders(square, occ);
     }
   }
@@ -260,7 +298,7 @@ void fill_rook_attacks() {
     for (int i = 0; i < occ_var; i++) {
 
       uint64_t occ = set_occ(i, bits, RookMasks[square]);
-      uint64_t magic_idx = occ * RookMagics[square] >> 52;
+      uint64_t magic_idx = rook_index(square, occ);
       RookAttacks[square][magic_idx] = rook_sliders(square, occ);
     }
   }
@@ -337,11 +375,11 @@ void fill_pawn_attacks() {
 }
 
 uint64_t get_bishop_attacks(int sq, uint64_t occ) {
-  return BishopAttacks[sq][(occ & BishopMasks[sq]) * BishopMagics[sq] >> 55];
+  return BishopAttacks[sq][bishop_index(sq, occ)];
 }
 
 uint64_t get_rook_attacks(int sq, uint64_t occ) {
-  return RookAttacks[sq][(occ & RookMasks[sq]) * RookMagics[sq] >> 52];
+  return RookAttacks[sq][rook_index(sq, occ)];
 }
 
 void init_bbs() {
@@ -379,7 +417,7 @@ void init_bbs() {
   }
 }
 
-void generate_bb(std::string fen, Position &pos) {
+void generate_bb(std::string_view fen, Position &pos) {
   std::memset(&pos, 0, sizeof(pos));
   int sq = a8;
 
@@ -414,7 +452,7 @@ void generate_bb(std::string fen, Position &pos) {
         break;
       default:
         printf("Unexpected error occured parsing FEN!\n");
-        printf("%s %c\n", fen.c_str(), c);
+        printf("%.*s %c\n", int(fen.size()), fen.data(), c);
         exit(1);
       }
 
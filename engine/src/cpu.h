@@ -0,0 +1,59 @@
+#pragma once
+
+// The x86-64 instruction set levels the NNUE kernels and slider lookups are
+// built for. Each level includes everything below it.
+namespace CpuLevels {
+constexpr int Generic = 0;
+constexpr int AVX2 = 1;
+constexpr int AVX2_BMI2 = 2;
+constexpr int AVX512BW = 3;
+constexpr int AVX512VNNI = 4;
+} // namespace CpuLevels
+
+constexpr const char *CpuLevelNames[] = {"generic", "avx2", "avx2-bmi2",
+                                         "avx512bw", "avx512vnni"};
+
+constexpr int compiled_cpu_level() {
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__) && defined(__BMI2__)
+  return CpuLevels::AVX512VNNI;
+#elif defined(__AVX512BW__) && defined(__BMI2__)
+  return CpuLevels::AVX512BW;
+#elif defined(__AVX2__) && defined(__BMI2__)
+  return CpuLevels::AVX2_BMI2;
+#elif defined(__AVX2__)
+  return CpuLevels::AVX2;
+#else
+  return CpuLevels::Generic;
+#endif
+}
+
+int detect_cpu_level() {
+  // Queries cpuid (and the OS's saved register state) for the best level
+  // this host can run.
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool bmi2 = __builtin_cpu_supports("bmi2");
+
+  if (avx2 && bmi2 && __builtin_cpu_supports("avx512bw")) {
+    return __builtin_cpu_supports("avx512vnni") ? CpuLevels::AVX512VNNI
+                                                : CpuLevels::AVX512BW;
+  }
+  if (avx2 && bmi2) {
+    return CpuLevels::AVX2_BMI2;
+  }
+  if (avx2) {
+    return CpuLevels::AVX2;
+  }
+#endif
+  return CpuLevels::Generic;
+}
+
+// A native build runs at the level it was compiled for, while a dispatch
+// build (make dist) picks the best level the host supports at startup.
+#if defined(USE_DISPATCH)
+const int g_cpu_level = detect_cpu_level();
+#else
+constexpr int g_cpu_level = compiled_cpu_level();
+#endif
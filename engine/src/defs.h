@@ -165,9 +165,20 @@ struct TTBucket {
   int16_t padding;
 };
 
+// Eval cache stuff
+
+struct EvalCacheEntry {
+  uint32_t key; // The lower 32 bits of the hash key, mixed with the phase
+  int32_t eval; // Raw NNUE output
+};
+
 struct RootMoveInfo {
   Move move;
   uint64_t nodes;
+  int score = ScoreNone;          // ScoreNone unless it was exact this iteration
+  int previous_score = ScoreNone; // score from the last completed iteration
+  int seldepth = 0;
+  std::array<Move, MaxSearchDepth> pv = {};
 };
 
 constexpr std::array<int, 7> SeeValues = {
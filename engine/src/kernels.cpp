@@ -0,0 +1,12 @@
+// Built once per instruction set level by `make dist`, each time with that
+// level's -m flags and -DSIMD_ARCH=<level>. The engine picks one of the
+// exported tables at startup (see select_kernels in nnue.h).
+
+#include "nnue_kernels.h"
+
+namespace SIMD_ARCH {
+
+extern const NNUE_Kernels dispatch_table;
+const NNUE_Kernels dispatch_table = kernel_table;
+
+} // namespace SIMD_ARCH
@@ -386,6 +386,10 @@ void score_moves(Position &position, ThreadInfo &thread_info,
         scored_moves.scores[idx] +=
             thread_info.ContHistScores[our_piece][our_last][piece][to];
       }
+      if (thread_info.quiet_noise) {
+        scored_moves.scores[idx] +=
+            next_random(thread_info.rng) % (thread_info.quiet_noise + 1);
+      }
     }
   }
 }
@@ -0,0 +1,126 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of a net file. The mapped weights are backed by
+// the page cache, so every engine process on a host that loads the same file
+// shares one physical copy of it.
+
+class MappedFile {
+public:
+  MappedFile() {}
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { close(); }
+
+  bool open(const std::string &path);
+  void close();
+
+  const void *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const void *m_data = nullptr;
+  size_t m_size = 0;
+
+#ifdef _WIN32
+  HANDLE m_mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &path) {
+  close();
+
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  // The mapping keeps its own reference to the file.
+  m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!m_mapping) {
+    return false;
+  }
+
+  m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!m_data) {
+    CloseHandle(m_mapping);
+    m_mapping = nullptr;
+    return false;
+  }
+
+  m_size = static_cast<size_t>(size.QuadPart);
+  return true;
+}
+
+void MappedFile::close() {
+  if (m_data) {
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+  }
+  m_data = nullptr, m_mapping = nullptr, m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string &path) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || info.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // The mapping stays valid after the descriptor is closed.
+  void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  m_data = data;
+  m_size = static_cast<size_t>(info.st_size);
+  return true;
+}
+
+void MappedFile::close() {
+  if (m_data) {
+    munmap(const_cast<void *>(m_data), m_size);
+  }
+  m_data = nullptr, m_size = 0;
+}
+
+#endif
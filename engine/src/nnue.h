@@ -1,11 +1,21 @@
 #pragma once
+#include "bitboard.h"
 #include "defs.h"
-#include "simd.h"
+#include "netfile.h"
+#include "nnue_kernels.h"
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
 #include <span>
+#include <string>
+#include <type_traits>
 #include <vector>
 #ifdef _MSC_VER
 #define W_MSVC
@@ -16,297 +26,1134 @@
 #define INCBIN_PREFIX g_
 #include "incbin.h"
 
+// incbin aligns for the instruction set the file is compiled with, but a
+// dispatch build may run AVX-512 kernels on the embedded net.
+#undef INCBIN_ALIGNMENT
+#define INCBIN_ALIGNMENT 64
+
 #ifdef W_MSVC
 #pragma pop_macro("_MSC_VER")
 #undef W_MSVC
 #endif
 
-constexpr size_t INPUT_SIZE = 768;
-constexpr size_t LAYER1_SIZE = 256;
+// A net file is either a bare legacy net (feature weights, feature bias,
+// output weights, output bias, as exported by bullet) or a versioned net that
+// starts with a NetHeader. Versioned nets can have several output buckets,
+// chosen by the number of pieces on the board, and (from version 2) several
+// king buckets of input features, chosen by the square of the perspective's
+// own king and optionally mirrored so that the king is always on files a-d.
+// From version 3, a net with nonzero layer sizes replaces the output layer
+// with a stack of hidden layers per output bucket (see LayerStack).
+// Everything is little endian, and the header is padded so the weights after
+// it stay 64 byte aligned.
+//
+//   NetHeader
+//   feature_v    [input_buckets][INPUT_SIZE][LAYER1_SIZE]
+//   feature_bias [LAYER1_SIZE]
+//   output_v     [output_buckets][LAYER1_SIZE * 2]    single layer nets
+//   output_bias  [output_buckets]
+//   layers       [output_buckets] LayerStack          layered nets
+
+constexpr std::array<char, 4> NET_MAGIC = {'P', 'N', 'E', 'T'};
+constexpr uint32_t NET_VERSION = 3;
+constexpr int MAX_OUTPUT_BUCKETS = 32;
+constexpr int MAX_INPUT_BUCKETS = 32;
+
+namespace NetFlags {
+constexpr uint32_t Mirrored = 1;
+}
 
-constexpr int SCRELU_MIN = 0;
-constexpr int SCRELU_MAX = 255;
+struct alignas(64) NetHeader {
+  std::array<char, 4> magic;
+  uint32_t version;
+  uint32_t input_size;
+  uint32_t hidden_size;
+  uint32_t output_buckets;
+  // Version 2
+  uint32_t input_buckets;
+  uint32_t flags;
+  std::array<uint8_t, 64> king_buckets; // indexed by the relative king square
+  // Version 3, both zero for a single output layer
+  uint32_t l1_size;
+  uint32_t l2_size;
+};
 
-constexpr int SCALE = 400;
+// Version 1 headers end after output_buckets, padded to 64 bytes.
+constexpr size_t net_header_size(uint32_t version) {
+  return version == 1 ? 64 : sizeof(NetHeader);
+}
 
-constexpr int QA = 255;
-constexpr int QB = 64;
+constexpr size_t net_data_size(int input_buckets, int output_buckets,
+                               bool layered = false) {
+  return (input_buckets * INPUT_SIZE * LAYER1_SIZE + LAYER1_SIZE) *
+             sizeof(int16_t) +
+         output_buckets * (layered ? sizeof(LayerStack)
+                                   : (LAYER1_SIZE * 2 + 1) * sizeof(int16_t));
+}
 
-const auto SCRELU_MIN_VEC = get_int16_vec(SCRELU_MIN);
-const auto QA_VEC = get_int16_vec(QA);
+// Legacy nets may carry padding up to the next 64 bytes after the bias.
+constexpr size_t LEGACY_NET_SIZE = net_data_size(1, 1);
+constexpr size_t LEGACY_NET_PADDED_SIZE = (LEGACY_NET_SIZE + 63) / 64 * 64;
+
+// The feature transformer rows one perspective uses for a given king
+// position: its king bucket's block of weights, and the flip that makes
+// squares relative to the perspective (vertical for black, horizontal when
+// the king is mirrored).
+struct PerspectiveRows {
+  const int16_t *weights;
+  int perspective;
+  int flip;
+
+  const int16_t *row(int piece, int sq) const {
+    constexpr size_t color_stride = 64 * 6;
+    constexpr size_t piece_stride = 64;
+
+    const size_t idx = ((piece & 1) ^ perspective) * color_stride +
+                       (piece / 2 - 1) * piece_stride + (sq ^ flip);
+    return &weights[idx * LAYER1_SIZE];
+  }
+};
 
-constexpr int QAB = QA * QB;
+// A view of a net's weights, which live either in the binary or in a mapped
+// net file.
+struct Network {
+  const int16_t *feature_v;
+  const Layer1 *feature_bias;
+  const OutputWeights *output_v; // one per output bucket
+  const int16_t *output_bias;    // one per output bucket
+  const LayerStack *layers;      // one per output bucket, or null
+  int output_buckets;
+  int input_buckets;
+  bool mirrored;
+  std::array<uint8_t, 64> king_buckets;
+
+  int output_bucket(int piece_count) const {
+    const int divisor = (32 + output_buckets - 1) / output_buckets;
+    return std::min((piece_count - 2) / divisor, output_buckets - 1);
+  }
+
+  // Which block of input features (king bucket and mirroring) a perspective
+  // uses. A king move that changes this can't be applied incrementally.
+  int king_slot(int perspective, int king_sq) const {
+    const int sq = perspective == Colors::Black ? king_sq ^ 56 : king_sq;
+    const bool mirror = mirrored && (sq & 7) >= 4;
+    return king_buckets[mirror ? sq ^ 7 : sq] * 2 + mirror;
+  }
 
-struct alignas(64) NNUE_Params {
-  std::array<int16_t, INPUT_SIZE * LAYER1_SIZE> feature_v;
-  std::array<int16_t, LAYER1_SIZE> feature_bias;
-  std::array<int16_t, LAYER1_SIZE * 2> output_v;
-  int16_t output_bias;
+  PerspectiveRows perspective_rows(int perspective, int king_sq) const {
+    const int slot = king_slot(perspective, king_sq);
+    return {&feature_v[(slot / 2) * INPUT_SIZE * LAYER1_SIZE], perspective,
+            (perspective == Colors::Black ? 56 : 0) ^ (slot % 2 ? 7 : 0)};
+  }
 };
 
-INCBIN(nnue, "nets/firefly.nnue");
-INCBIN(nnue2, "nets/firefly.nnue");
-INCBIN(nnue3, "nets/firefly.nnue");
+bool parse_net(const void *data, size_t size, Network &net) {
+  if constexpr (std::endian::native != std::endian::little) {
+    printf("info string Net files are little endian, this host is not\n");
+    return false;
+  }
 
-const NNUE_Params &g_nnue = *reinterpret_cast<const NNUE_Params *>(g_nnueData);
-const NNUE_Params &g_nnue2 =
-    *reinterpret_cast<const NNUE_Params *>(g_nnue2Data);
-const NNUE_Params &g_nnue3 =
-    *reinterpret_cast<const NNUE_Params *>(g_nnue3Data);
+  const auto *bytes = static_cast<const char *>(data);
 
-template <size_t HiddenSize> struct alignas(64) Accumulator {
-  std::array<int16_t, HiddenSize> white;
-  std::array<int16_t, HiddenSize> black;
+  net.output_buckets = 1;
+  net.input_buckets = 1;
+  net.mirrored = false;
+  net.king_buckets = {};
+  net.layers = nullptr;
 
-  inline void init(std::span<const int16_t, HiddenSize> bias) {
-    std::memcpy(white.data(), bias.data(), bias.size_bytes());
-    std::memcpy(black.data(), bias.data(), bias.size_bytes());
+  NetHeader header;
+  std::memcpy(&header, bytes, std::min(size, sizeof(header)));
+
+  if (size >= net_header_size(1) && header.magic == NET_MAGIC) {
+    if (header.version < 1 || header.version > NET_VERSION) {
+      printf("info string Net version %u is not supported (expected 1 to "
+             "%u)\n",
+             header.version, NET_VERSION);
+      return false;
+    }
+    if (header.input_size != INPUT_SIZE || header.hidden_size != LAYER1_SIZE) {
+      printf("info string Net is %ux%u, expected %zux%zu\n", header.input_size,
+             header.hidden_size, INPUT_SIZE, LAYER1_SIZE);
+      return false;
+    }
+    if (header.output_buckets < 1 ||
+        header.output_buckets > MAX_OUTPUT_BUCKETS) {
+      printf("info string Net has %u output buckets, expected 1 to %d\n",
+             header.output_buckets, MAX_OUTPUT_BUCKETS);
+      return false;
+    }
+    net.output_buckets = header.output_buckets;
+
+    if (header.version >= 2) {
+      if (header.input_buckets < 1 ||
+          header.input_buckets > MAX_INPUT_BUCKETS) {
+        printf("info string Net has %u king buckets, expected 1 to %d\n",
+               header.input_buckets, MAX_INPUT_BUCKETS);
+        return false;
+      }
+      for (uint8_t bucket : header.king_buckets) {
+        if (bucket >= header.input_buckets) {
+          printf("info string Net maps a king square to bucket %u of %u\n",
+                 bucket, header.input_buckets);
+          return false;
+        }
+      }
+      net.input_buckets = header.input_buckets;
+      net.mirrored = header.flags & NetFlags::Mirrored;
+      net.king_buckets = header.king_buckets;
+    }
+
+    const bool layered =
+        header.version >= 3 && (header.l1_size || header.l2_size);
+    if (layered && (header.l1_size != L1_SIZE || header.l2_size != L2_SIZE)) {
+      printf("info string Net has %ux%u hidden layers, expected %zux%zu\n",
+             header.l1_size, header.l2_size, L1_SIZE, L2_SIZE);
+      return false;
+    }
+
+    const size_t header_size = net_header_size(header.version);
+    const size_t expected =
+        header_size +
+        net_data_size(net.input_buckets, net.output_buckets, layered);
+    if (size < expected) {
+      printf("info string Net has size %zu, expected %zu bytes\n", size,
+             expected);
+      return false;
+    }
+    bytes += header_size;
+
+    if (layered) {
+      net.layers = reinterpret_cast<const LayerStack *>(
+          bytes + net_data_size(net.input_buckets, 0));
+    }
   }
-};
 
-constexpr int32_t screlu(int16_t x) {
-  const auto clipped =
-      std::clamp(static_cast<int32_t>(x), SCRELU_MIN, SCRELU_MAX);
-  return clipped * clipped;
+  else if (size < LEGACY_NET_SIZE || size > LEGACY_NET_PADDED_SIZE) {
+    printf("info string Net has size %zu, expected %zu bytes for a %zux%zu "
+           "net\n",
+           size, LEGACY_NET_SIZE, INPUT_SIZE, LAYER1_SIZE);
+    return false;
+  }
+
+  const auto *weights = reinterpret_cast<const int16_t *>(bytes);
+
+  net.feature_v = weights;
+  weights += net.input_buckets * INPUT_SIZE * LAYER1_SIZE;
+  net.feature_bias = reinterpret_cast<const Layer1 *>(weights);
+  weights += LAYER1_SIZE;
+
+  if (net.layers) {
+    net.output_v = nullptr, net.output_bias = nullptr;
+  } else {
+    net.output_v = reinterpret_cast<const OutputWeights *>(weights);
+    weights += LAYER1_SIZE * 2 * net.output_buckets;
+    net.output_bias = weights;
+  }
+  return true;
 }
 
-template <size_t size, size_t v>
-inline void add_to_all(std::array<int16_t, size> &output,
-                       std::array<int16_t, size> &input,
-                       const std::array<int16_t, v> &delta, size_t offset) {
-  for (size_t i = 0; i < size; ++i) {
-    output[i] = input[i] + delta[offset + i];
+// All three phases embed the same net, so it is only included once.
+INCBIN(nnue, "nets/firefly.nnue");
+
+Network embedded_net() {
+  Network net;
+  parse_net(g_nnueData, g_nnueSize, net);
+  return net;
+}
+
+const Network g_embedded_net = embedded_net();
+
+// The nets used for the middlegame, endgame and sacrifice phases. They are
+// the embedded net unless a file was loaded with the EvalFile options.
+std::array<Network, 3> g_nets = {g_embedded_net, g_embedded_net,
+                                 g_embedded_net};
+
+// Nets whose feature transformers are the same only differ in their output
+// layers, so switching between them doesn't need an accumulator refresh.
+bool shares_feature_transformer(int phase1, int phase2) {
+  return g_nets[phase1].feature_v == g_nets[phase2].feature_v;
+}
+
+// The lowest phase whose net has the same feature transformer as phase's.
+// Accumulators and refresh cache entries are kept per feature transformer,
+// under this index.
+int ft_slot(int phase) {
+  int slot = 0;
+  while (!shares_feature_transformer(slot, phase)) {
+    slot++;
   }
+  return slot;
 }
 
-template <size_t size, size_t v>
-inline void subtract_from_all(std::array<int16_t, size> &output,
-                              std::array<int16_t, size> &input,
-                              const std::array<int16_t, v> &delta,
-                              size_t offset) {
+int count_feature_transformers() {
+  int count = 0;
+  for (int phase = 0; phase < 3; phase++) {
+    count += ft_slot(phase) == phase;
+  }
+  return count;
+}
 
-  for (size_t i = 0; i < size; ++i) {
-    output[i] = input[i] - delta[offset + i];
+// Calls f with phase as a compile-time constant (a std::integral_constant).
+// The NNUE code that runs per node is specialized on the phase, so the net
+// it reads is at a fixed address; this is where a runtime phase is turned
+// into a template argument.
+template <typename F> decltype(auto) with_phase(int phase, F &&f) {
+  switch (phase) {
+  case PhaseTypes::Endgame:
+    return f(std::integral_constant<int, PhaseTypes::Endgame>{});
+  case PhaseTypes::Sacrifice:
+    return f(std::integral_constant<int, PhaseTypes::Sacrifice>{});
+  default:
+    return f(std::integral_constant<int, PhaseTypes::Middlegame>{});
   }
 }
 
-std::pair<size_t, size_t> feature_indices(int piece, int sq) {
-  constexpr size_t color_stride = 64 * 6;
-  constexpr size_t piece_stride = 64;
+// Bumped whenever a net changes so that cached accumulators built from the
+// previous weights are discarded.
+uint64_t g_net_generation = 0;
+
+struct NetFile {
+  std::string path; // canonical path, empty for the embedded net
+  std::shared_ptr<MappedFile> mapping;
+};
+
+std::array<NetFile, 3> g_net_files;
 
-  const auto base = static_cast<int>(piece / 2 - 1);
-  const size_t color = piece & 1;
+bool load_net(int phase, const std::string &path) {
+  // Maps a net file for the given phase. An empty path or "<internal>"
+  // switches the phase back to the embedded net.
 
-  const auto whiteIdx =
-      color * color_stride + base * piece_stride + static_cast<size_t>(sq);
-  const auto blackIdx = (color ^ 1) * color_stride + base * piece_stride +
-                        (static_cast<size_t>(sq ^ 56));
+  if (path.empty() || path == "<internal>") {
+    g_net_files[phase] = {};
+    g_nets[phase] = g_embedded_net;
+    g_net_generation++;
+    return true;
+  }
+
+  std::error_code error;
+  std::string canonical = std::filesystem::weakly_canonical(path, error).string();
+  if (error) {
+    canonical = path;
+  }
 
-  return {whiteIdx, blackIdx};
+  // Phases that point at the same file share its mapping.
+  std::shared_ptr<MappedFile> mapping;
+  for (auto &file : g_net_files) {
+    if (file.mapping && file.path == canonical) {
+      mapping = file.mapping;
+    }
+  }
+
+  if (!mapping) {
+    mapping = std::make_shared<MappedFile>();
+    if (!mapping->open(path)) {
+      printf("info string Could not open net file %s\n", path.c_str());
+      return false;
+    }
+    if (reinterpret_cast<uintptr_t>(mapping->data()) % 64) {
+      printf("info string Net mapping is not 64 byte aligned\n");
+      return false;
+    }
+  }
+
+  Network net;
+  if (!parse_net(mapping->data(), mapping->size(), net)) {
+    return false;
+  }
+
+  g_net_files[phase] = {canonical, mapping};
+  g_nets[phase] = net;
+  g_net_generation++;
+
+  printf("info string Loaded net %s (%d king bucket%s%s, %d output "
+         "bucket%s%s)\n",
+         path.c_str(), net.input_buckets, net.input_buckets == 1 ? "" : "s",
+         net.mirrored ? " mirrored" : "", net.output_buckets,
+         net.output_buckets == 1 ? "" : "s",
+         net.layers ? ", hidden layers" : "");
+  return true;
 }
 
-inline int32_t
-screlu_flatten(const std::array<int16_t, LAYER1_SIZE> &us,
-               const std::array<int16_t, LAYER1_SIZE> &them,
-               const std::array<int16_t, LAYER1_SIZE * 2> &weights) {
+template <size_t HiddenSize> struct alignas(64) Accumulator {
+  std::array<int16_t, HiddenSize> white;
+  std::array<int16_t, HiddenSize> black;
+
+  inline void init(std::span<const int16_t, HiddenSize> bias) {
+    std::memcpy(white.data(), bias.data(), bias.size_bytes());
+    std::memcpy(black.data(), bias.data(), bias.size_bytes());
+  }
+};
 
-#if defined(__AVX512F__) || defined(__AVX2__)
+#if defined(USE_DISPATCH)
+namespace avx2 {
+extern const NNUE_Kernels dispatch_table;
+}
+namespace avx512bw {
+extern const NNUE_Kernels dispatch_table;
+}
+namespace avx512vnni {
+extern const NNUE_Kernels dispatch_table;
+}
+#endif
 
-  auto sum = vec_int32_zero();
+const NNUE_Kernels *select_kernels() {
+#if defined(USE_DISPATCH)
+  if (g_cpu_level >= CpuLevels::AVX512VNNI) {
+    return &avx512vnni::dispatch_table;
+  }
+  if (g_cpu_level >= CpuLevels::AVX512BW) {
+    return &avx512bw::dispatch_table;
+  }
+  if (g_cpu_level >= CpuLevels::AVX2) {
+    return &avx2::dispatch_table;
+  }
+#endif
+  return &SIMD_ARCH::kernel_table;
+}
 
-  for (size_t i = 0; i < LAYER1_SIZE; i += REGISTER_SIZE) {
+#if defined(USE_DISPATCH)
+const NNUE_Kernels *const g_kernels = select_kernels();
+#endif
 
-    auto v_us = int16_load(&us[i]);
-    auto w_us = int16_load(&weights[i]);
+// The kernels for the level the engine runs at. Native builds resolve this at
+// compile time so the kernels still get inlined.
+inline const NNUE_Kernels &kernels() {
+#if defined(USE_DISPATCH)
+  return *g_kernels;
+#else
+  return SIMD_ARCH::kernel_table;
+#endif
+}
 
-    v_us = vec_int16_clamp(v_us, SCRELU_MIN_VEC, QA_VEC);
+std::vector<const NNUE_Kernels *> available_kernels() {
+  // Every kernel tier in this binary that the host can run.
+  std::vector<const NNUE_Kernels *> tiers = {&SIMD_ARCH::kernel_table};
+#if defined(USE_DISPATCH)
+  if (g_cpu_level >= CpuLevels::AVX2) {
+    tiers.push_back(&avx2::dispatch_table);
+  }
+  if (g_cpu_level >= CpuLevels::AVX512BW) {
+    tiers.push_back(&avx512bw::dispatch_table);
+  }
+  if (g_cpu_level >= CpuLevels::AVX512VNNI) {
+    tiers.push_back(&avx512vnni::dispatch_table);
+  }
+#endif
+  return tiers;
+}
 
-    auto our_product = vec_int16_multiply(v_us, w_us);
+bool test_kernels(int iterations = 20000) {
+  // Checks every available SIMD tier against the scalar reference on random
+  // accumulators and weight rows. The value ranges cover clamping on both
+  // sides while keeping activation * weight inside int16, as a real net does.
+
+  constexpr size_t ROWS = 32;
+  alignas(64) static int16_t weights[ROWS][LAYER1_SIZE];
+  alignas(64) static Layer1 input, expected, actual, them;
+  alignas(64) static OutputWeights output_v;
+  static LayerStack layers;
+  L1Output expected_l1, actual_l1;
+
+  std::mt19937 rng(0x5eed);
+  auto random_values = [&](int16_t *values, size_t count, int lo, int hi) {
+    std::uniform_int_distribution<int> values_dist(lo, hi);
+    for (size_t i = 0; i < count; i++) {
+      values[i] = values_dist(rng);
+    }
+  };
+  auto random_row = [&]() -> const int16_t * {
+    return weights[std::uniform_int_distribution<size_t>(0, ROWS - 1)(rng)];
+  };
+
+  const NNUE_Kernels &ref = SIMD_ARCH::scalar_kernel_table;
+  bool passed = true;
+
+  for (const NNUE_Kernels *tier : available_kernels()) {
+    int failures = 0;
+
+    for (int i = 0; i < iterations; i++) {
+      random_values(&weights[0][0], ROWS * LAYER1_SIZE, -128, 127);
+      random_values(input.data(), LAYER1_SIZE, -2048, 2048);
+
+      FeatureRows<2> adds = {random_row(), random_row()};
+      FeatureRows<2> subs = {random_row(), random_row()};
+      FeatureRows<1> add = {adds[0]}, sub = {subs[0]};
+
+      std::array<const int16_t *, ROWS> refresh_adds, refresh_subs;
+      size_t num_adds = rng() % (ROWS + 1), num_subs = rng() % (ROWS + 1);
+      for (size_t j = 0; j < ROWS; j++) {
+        refresh_adds[j] = random_row(), refresh_subs[j] = random_row();
+      }
+      FeatureRowSpan span_adds(refresh_adds.data(), num_adds);
+      FeatureRowSpan span_subs(refresh_subs.data(), num_subs);
+
+      auto check = [&](const char *kernel) {
+        if (expected != actual && failures++ == 0) {
+          printf("%s: %s differs from scalar (iteration %d)\n", tier->name,
+                 kernel, i);
+        }
+      };
+
+      ref.add_sub(expected.data(), input.data(), add, sub);
+      tier->add_sub(actual.data(), input.data(), add, sub);
+      check("add_sub");
+
+      ref.add_sub_sub(expected.data(), input.data(), add, subs);
+      tier->add_sub_sub(actual.data(), input.data(), add, subs);
+      check("add_sub_sub");
+
+      ref.add_add_sub_sub(expected.data(), input.data(), adds, subs);
+      tier->add_add_sub_sub(actual.data(), input.data(), adds, subs);
+      check("add_add_sub_sub");
+
+      ref.refresh(expected.data(), input.data(), span_adds, span_subs);
+      tier->refresh(actual.data(), input.data(), span_adds, span_subs);
+      check("refresh");
+
+      expected = input, actual = input;
+      int16_t *const expected_ptrs[] = {expected.data(), expected.data()};
+      int16_t *const actual_ptrs[] = {actual.data(), actual.data()};
+      ref.add_row_to_all(refresh_adds[0], expected_ptrs, 2);
+      tier->add_row_to_all(refresh_adds[0], actual_ptrs, 2);
+      check("add_row_to_all");
+
+      random_values(input.data(), LAYER1_SIZE, -300, 600);
+      random_values(them.data(), LAYER1_SIZE, -300, 600);
+      random_values(output_v.data(), LAYER1_SIZE * 2, -128, 127);
+
+      if (ref.screlu_flatten(input, them, output_v) !=
+              tier->screlu_flatten(input, them, output_v) &&
+          failures++ == 0) {
+        printf("%s: screlu_flatten differs from scalar (iteration %d)\n",
+               tier->name, i);
+      }
+
+      // Knock out random blocks of L1 inputs so the sparse paths skip some.
+      for (size_t block = 0; block < L1_BLOCKS; block++) {
+        if (rng() % 2) {
+          int16_t *x = block < L1_BLOCKS / 2
+                           ? &input[block * L1_BLOCK]
+                           : &them[block * L1_BLOCK - LAYER1_SIZE];
+          std::fill(x, x + L1_BLOCK, -1);
+        }
+      }
+      for (int8_t &weight : layers.l1_weights) {
+        weight = static_cast<int8_t>(rng());
+      }
+      for (int32_t &bias : layers.l1_bias) {
+        bias = static_cast<int32_t>(rng() % 200001) - 100000;
+      }
+
+      ref.l1_forward(input, them, layers, expected_l1);
+      tier->l1_forward(input, them, layers, actual_l1);
+      if (expected_l1 != actual_l1 && failures++ == 0) {
+        printf("%s: l1_forward differs from scalar (iteration %d)\n",
+               tier->name, i);
+      }
+    }
 
-    auto our_result = vec_int16_madd_int32(our_product, v_us);
+    printf("%s: %s (%d iterations)\n", tier->name,
+           failures ? "FAILED" : "ok", iterations);
+    passed &= !failures;
+  }
 
-    sum = vec_int32_add(sum, our_result);
+  return passed;
+}
 
-    auto v_them = int16_load(&them[i]);
-    auto w_them = int16_load(&weights[LAYER1_SIZE + i]);
+int propagate_layers(const Layer1 &us, const Layer1 &them,
+                     const LayerStack &layers) {
+  // The hidden layers of a layered net. L1 is the sparse integer kernel; L2
+  // and the output are tiny and run in float.
 
-    v_them = vec_int16_clamp(v_them, SCRELU_MIN_VEC, QA_VEC);
+  L1Output l1_output;
+  kernels().l1_forward(us, them, layers, l1_output);
 
-    auto their_product = vec_int16_multiply(v_them, w_them);
+  constexpr float l1_dequant = 1.0f / (L1_INPUT_MAX * QL1);
 
-    auto their_result = vec_int16_madd_int32(their_product, v_them);
+  std::array<float, L1_SIZE> l1;
+  for (size_t i = 0; i < L1_SIZE; i++) {
+    l1[i] = std::clamp(l1_output[i] * l1_dequant, 0.0f, 1.0f);
+  }
 
-    sum = vec_int32_add(sum, their_result);
+  float output = layers.output_bias;
+  for (size_t j = 0; j < L2_SIZE; j++) {
+    float l2 = layers.l2_bias[j];
+    for (size_t i = 0; i < L1_SIZE; i++) {
+      l2 += l1[i] * layers.l2_weights[j * L1_SIZE + i];
+    }
+    output += std::clamp(l2, 0.0f, 1.0f) * layers.output_weights[j];
   }
 
-  return vec_int32_hadd(sum) / QA;
+  return static_cast<int>(output * SCALE);
+}
 
-#else
+int evaluate_accumulator(const Network &net, const Layer1 &us,
+                         const Layer1 &them, int piece_count) {
+  // The layers after the feature transformer, for the side to move.
 
-  int32_t sum = 0;
+  const int bucket = net.output_bucket(piece_count);
 
-  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
-    sum += screlu(us[i]) * weights[i];
-    sum += screlu(them[i]) * weights[LAYER1_SIZE + i];
+  if (net.layers) {
+    return propagate_layers(us, them, net.layers[bucket]);
   }
 
-  return sum / QA;
+  const auto output = kernels().screlu_flatten(us, them, net.output_v[bucket]);
 
-#endif
+  return (output + net.output_bias[bucket]) * SCALE / QAB;
 }
 
+struct FeatureDelta {
+  uint8_t piece;
+  uint8_t square;
+};
+
+// The pieces that entered and left the board on one ply of the accumulator
+// stack. Moves only record these; the accumulator for the ply is built from
+// its parent the first time an evaluation needs it. A perspective whose king
+// moved to another king bucket can't be built from its parent, so the board
+// is kept for it to be refreshed from instead.
+struct AccumulatorUpdate {
+  std::array<FeatureDelta, 2> adds;
+  std::array<FeatureDelta, 2> subs;
+  uint8_t num_adds;
+  uint8_t num_subs;
+  uint8_t phase;
+  bool computed;
+  std::array<uint8_t, 2> king_squares;
+  std::array<bool, 2> refresh;
+  std::array<uint64_t, 2> colors_bb;
+  std::array<uint64_t, 7> pieces_bb;
+};
+
+// One perspective of the last accumulator refreshed with a given net and king
+// slot, along with the board it was built from ("Finny table"). A refresh
+// only has to apply the pieces that differ between that board and the
+// current one.
+struct alignas(64) RefreshEntry {
+  std::array<int16_t, LAYER1_SIZE> accumulator;
+  std::array<uint64_t, 2> colors_bb;
+  std::array<uint64_t, 7> pieces_bb;
+  uint64_t generation = UINT64_MAX;
+};
+
+constexpr int MAX_KING_SLOTS = MAX_INPUT_BUCKETS * 2;
+
+// Opt-in (UCI option AllPhaseAccumulators): every ply keeps an accumulator for
+// each phase net, all updated together, so that switching phase mid search
+// only changes which one is read instead of refreshing. Costs one extra
+// incremental update per ply for each extra feature transformer in use.
+bool g_all_phase_accumulators = false;
+
 class NNUE_State {
 public:
-  Accumulator<LAYER1_SIZE> m_accumulator_stack[MaxSearchDepth];
-  Accumulator<LAYER1_SIZE> *m_curr;
-
-  void add_sub(int from_piece, int from, int to_piece, int to, int phase);
-  void add_sub_sub(int from_piece, int from, int to_piece, int to, int captured,
-                   int captured_pos, int phase);
-  void add_add_sub_sub(int piece1, int from1, int to1, int piece2, int from2,
-                       int to2, int phase);
+  // [feature transformer slot][ply]. Without all-phase accumulators only slot
+  // 0 is used, holding each ply's accumulator for the net of its phase.
+  MultiArray<Accumulator<LAYER1_SIZE>, 3, MaxSearchDepth> m_accumulator_stacks;
+  AccumulatorUpdate m_update_stack[MaxSearchDepth];
+  size_t m_ply = 0;
+
+  bool m_all_phases = false;
+  std::array<uint8_t, 3> m_phase_slot = {0, 0, 0}; // ft_slot of each phase
+  std::array<uint8_t, 3> m_slots = {0, 0, 0};      // the distinct slots
+  int m_num_slots = 1;
+
+  // [net][perspective][king slot]
+  MultiArray<RefreshEntry, 3, 2, MAX_KING_SLOTS> m_refresh_table;
+
+  uint64_t m_queued_updates = 0;  // updates recorded by moves
+  uint64_t m_applied_updates = 0; // updates that had to be materialized
+  uint64_t m_extra_updates = 0;   // updates for the other phases' nets
+  uint64_t m_phase_switches = 0;
+  uint64_t m_phase_refreshes = 0; // phase switches that refreshed
+  int64_t m_phase_refresh_ns = 0;
+  uint64_t m_rows_read = 0; // feature transformer rows applied
+
+  void add_sub(const Position &position, int from_piece, int from,
+               int to_piece, int to, int phase);
+  void add_sub_sub(const Position &position, int from_piece, int from,
+                   int to_piece, int to, int captured, int captured_pos,
+                   int phase);
+  void add_add_sub_sub(const Position &position, int piece1, int from1,
+                       int to1, int piece2, int from2, int to2, int phase);
   void pop();
-  int evaluate(int color, int phase);
+  int evaluate(const Position &position, int phase);
+  template <int Phase> int evaluate(const Position &position);
   void reset_nnue(const Position &position, int phase);
   void change_phases(const Position &position, int phase);
-  void reset_and_add_sub_sub(const Position &position, int from_piece, int from,
-                             int to_piece, int to, int captured,
-                             int captured_sq, int phase);
-
-  template <bool Activate>
-  inline void update_feature(int piece, int square, int phase);
+  void switch_root_phase(const Position &position, int phase);
+  bool free_phase_switch(int from, int to) const;
+
+  AccumulatorUpdate &push_update(const Position &position, int phase);
+  void apply_update(size_t ply);
+  template <int Phase>
+  void apply_update_perspective(size_t ply, int perspective, int slot);
+  void apply_updates();
+
+  void refresh(const Position &position, int phase);
+  template <int Phase>
+  void refresh_perspective(int16_t *output, int perspective,
+                           const std::array<uint64_t, 2> &colors_bb,
+                           const std::array<uint64_t, 7> &pieces_bb);
+
+  Accumulator<LAYER1_SIZE> &accumulator(size_t ply, int phase) {
+    return m_accumulator_stacks[m_all_phases ? m_phase_slot[phase] : 0][ply];
+  }
 
   NNUE_State() {}
 };
 
-void NNUE_State::add_sub(int from_piece, int from, int to_piece, int to,
-                         int phase) {
+int king_square(const std::array<uint64_t, 2> &colors_bb,
+                const std::array<uint64_t, 7> &pieces_bb, int color) {
+  return get_lsb(colors_bb[color] & pieces_bb[PieceTypes::King]);
+}
+
+AccumulatorUpdate &NNUE_State::push_update(const Position &position,
+                                           int phase) {
+  // position is the board after the move.
+
+  m_ply++;
+
+  AccumulatorUpdate &update = m_update_stack[m_ply];
+  const AccumulatorUpdate &parent = m_update_stack[m_ply - 1];
+
+  update.num_adds = 0, update.num_subs = 0;
+  update.phase = phase;
+  update.computed = false;
 
-  const auto [white_from, black_from] = feature_indices(from_piece, from);
-  const auto [white_to, black_to] = feature_indices(to_piece, to);
+  m_phase_switches += phase != parent.phase;
 
-  const NNUE_Params *ptr =
-      (phase == PhaseTypes::Middlegame ? &g_nnue : phase == PhaseTypes::Endgame ? &g_nnue2 : &g_nnue3);
+  for (int perspective : {Colors::White, Colors::Black}) {
+    const int king_sq =
+        king_square(position.colors_bb, position.pieces_bb, perspective);
 
-  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
-    m_curr[1].white[i] = m_curr->white[i] +
-                         ptr->feature_v[white_to * LAYER1_SIZE + i] -
-                         ptr->feature_v[white_from * LAYER1_SIZE + i];
+    auto king_slot_changed = [&](const Network &net) {
+      return net.king_slot(perspective, king_sq) !=
+             net.king_slot(perspective, parent.king_squares[perspective]);
+    };
 
-    m_curr[1].black[i] = m_curr->black[i] +
-                         ptr->feature_v[black_to * LAYER1_SIZE + i] -
-                         ptr->feature_v[black_from * LAYER1_SIZE + i];
+    update.king_squares[perspective] = king_sq;
+    update.refresh[perspective] = king_slot_changed(g_nets[phase]);
+
+    if (m_all_phases) {
+      for (int i = 0; i < m_num_slots; i++) {
+        update.refresh[perspective] |= king_slot_changed(g_nets[m_slots[i]]);
+      }
+    }
+  }
+
+  if (update.refresh[Colors::White] || update.refresh[Colors::Black]) {
+    update.colors_bb = position.colors_bb;
+    update.pieces_bb = position.pieces_bb;
   }
 
-  m_curr++;
+  m_queued_updates++;
+  return update;
+}
+
+void NNUE_State::add_sub(const Position &position, int from_piece, int from,
+                         int to_piece, int to, int phase) {
+
+  AccumulatorUpdate &update = push_update(position, phase);
+
+  update.adds[update.num_adds++] = {uint8_t(to_piece), uint8_t(to)};
+  update.subs[update.num_subs++] = {uint8_t(from_piece), uint8_t(from)};
+}
+
+void NNUE_State::add_sub_sub(const Position &position, int from_piece,
+                             int from, int to_piece, int to, int captured,
+                             int captured_sq, int phase) {
+
+  AccumulatorUpdate &update = push_update(position, phase);
+
+  update.adds[update.num_adds++] = {uint8_t(to_piece), uint8_t(to)};
+  update.subs[update.num_subs++] = {uint8_t(from_piece), uint8_t(from)};
+  update.subs[update.num_subs++] = {uint8_t(captured), uint8_t(captured_sq)};
 }
 
-void NNUE_State::add_sub_sub(int from_piece, int from, int to_piece, int to,
-                             int captured, int captured_sq, int phase) {
-  const auto [white_from, black_from] = feature_indices(from_piece, from);
-  const auto [white_to, black_to] = feature_indices(to_piece, to);
-  const auto [white_capt, black_capt] = feature_indices(captured, captured_sq);
+void NNUE_State::add_add_sub_sub(const Position &position, int piece1,
+                                 int from1, int to1, int piece2, int from2,
+                                 int to2, int phase) {
 
-  const NNUE_Params *ptr =
-      (phase == PhaseTypes::Middlegame ? &g_nnue : phase == PhaseTypes::Endgame ? &g_nnue2 : &g_nnue3);
+  AccumulatorUpdate &update = push_update(position, phase);
 
-  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
-    m_curr[1].white[i] = m_curr->white[i] +
-                         ptr->feature_v[white_to * LAYER1_SIZE + i] -
-                         ptr->feature_v[white_from * LAYER1_SIZE + i] -
-                         ptr->feature_v[white_capt * LAYER1_SIZE + i];
+  update.adds[update.num_adds++] = {uint8_t(piece1), uint8_t(to1)};
+  update.adds[update.num_adds++] = {uint8_t(piece2), uint8_t(to2)};
+  update.subs[update.num_subs++] = {uint8_t(piece1), uint8_t(from1)};
+  update.subs[update.num_subs++] = {uint8_t(piece2), uint8_t(from2)};
+}
+
+template <int Phase>
+void NNUE_State::apply_update_perspective(size_t ply, int perspective,
+                                          int slot) {
+  // Builds one perspective of the accumulator in the given slot at ply from
+  // the one below it, with Phase's net.
+
+  const AccumulatorUpdate &update = m_update_stack[ply];
+  const Network &net = g_nets[Phase];
+
+  const auto &input = m_accumulator_stacks[slot][ply - 1];
+  auto &output = m_accumulator_stacks[slot][ply];
 
-    m_curr[1].black[i] = m_curr->black[i] +
-                         ptr->feature_v[black_to * LAYER1_SIZE + i] -
-                         ptr->feature_v[black_from * LAYER1_SIZE + i] -
-                         ptr->feature_v[black_capt * LAYER1_SIZE + i];
+  int16_t *out = perspective == Colors::White ? output.white.data()
+                                              : output.black.data();
+  const int16_t *in = perspective == Colors::White ? input.white.data()
+                                                   : input.black.data();
+
+  if (update.refresh[perspective]) {
+    refresh_perspective<Phase>(out, perspective, update.colors_bb,
+                               update.pieces_bb);
+    return;
   }
 
-  m_curr++;
+  const PerspectiveRows rows =
+      net.perspective_rows(perspective, update.king_squares[perspective]);
+
+  FeatureRows<2> adds, subs;
+  m_rows_read += update.num_adds + update.num_subs;
+
+  for (int i = 0; i < update.num_adds; i++) {
+    adds[i] = rows.row(update.adds[i].piece, update.adds[i].square);
+  }
+  for (int i = 0; i < update.num_subs; i++) {
+    subs[i] = rows.row(update.subs[i].piece, update.subs[i].square);
+  }
+
+  if (update.num_adds == 2) { // castling
+    kernels().add_add_sub_sub(out, in, adds, subs);
+  } else if (update.num_subs == 2) { // capture
+    kernels().add_sub_sub(out, in, FeatureRows<1>{adds[0]}, subs);
+  } else {
+    kernels().add_sub(out, in, FeatureRows<1>{adds[0]},
+                      FeatureRows<1>{subs[0]});
+  }
 }
 
-void NNUE_State::add_add_sub_sub(int piece1, int from1, int to1, int piece2,
-                                 int from2, int to2, int phase) {
-  const auto [white_from1, black_from1] = feature_indices(piece1, from1);
-  const auto [white_to1, black_to1] = feature_indices(piece1, to1);
-  const auto [white_from2, black_from2] = feature_indices(piece2, from2);
-  const auto [white_to2, black_to2] = feature_indices(piece2, to2);
+void NNUE_State::apply_update(size_t ply) {
+  // Builds the accumulator at ply from the one below it. With all-phase
+  // accumulators every net's is built, one after another for each
+  // perspective while its parents and the update are still in cache.
+
+  AccumulatorUpdate &update = m_update_stack[ply];
+
+  for (int perspective : {Colors::White, Colors::Black}) {
+    if (m_all_phases) {
+      for (int i = 0; i < m_num_slots; i++) {
+        with_phase(m_slots[i], [&](auto phase) {
+          apply_update_perspective<phase.value>(ply, perspective, phase.value);
+        });
+      }
+    } else {
+      with_phase(update.phase, [&](auto phase) {
+        apply_update_perspective<phase.value>(ply, perspective, 0);
+      });
+    }
+  }
+
+  update.computed = true;
+  m_applied_updates++;
+  m_extra_updates += m_all_phases ? m_num_slots - 1 : 0;
+}
 
-  const NNUE_Params *ptr =
-      (phase == PhaseTypes::Middlegame ? &g_nnue : phase == PhaseTypes::Endgame ? &g_nnue2 : &g_nnue3);
+void NNUE_State::apply_updates() {
+  // Walk back to the last ply with a computed accumulator, then replay the
+  // recorded updates forward to the current ply.
 
-  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
-    m_curr[1].white[i] = m_curr->white[i] +
-                         ptr->feature_v[white_to1 * LAYER1_SIZE + i] -
-                         ptr->feature_v[white_from1 * LAYER1_SIZE + i] +
-                         ptr->feature_v[white_to2 * LAYER1_SIZE + i] -
-                         ptr->feature_v[white_from2 * LAYER1_SIZE + i];
+  size_t computed = m_ply;
 
-    m_curr[1].black[i] = m_curr->black[i] +
-                         ptr->feature_v[black_to1 * LAYER1_SIZE + i] -
-                         ptr->feature_v[black_from1 * LAYER1_SIZE + i] +
-                         ptr->feature_v[black_to2 * LAYER1_SIZE + i] -
-                         ptr->feature_v[black_from2 * LAYER1_SIZE + i];
+  while (!m_update_stack[computed].computed) {
+    computed--;
   }
 
-  m_curr++;
+  for (size_t i = computed + 1; i <= m_ply; i++) {
+    apply_update(i);
+  }
+}
+
+void NNUE_State::pop() { m_ply--; }
+
+int NNUE_State::evaluate(const Position &position, int phase) {
+  return with_phase(phase, [&](auto phase) {
+    return evaluate<phase.value>(position);
+  });
 }
 
-void NNUE_State::pop() { m_curr--; }
+template <int Phase> int NNUE_State::evaluate(const Position &position) {
 
-int NNUE_State::evaluate(int color, int phase) {
+  apply_updates();
 
-  const NNUE_Params *ptr =
-      (phase == PhaseTypes::Middlegame ? &g_nnue : phase == PhaseTypes::Endgame ? &g_nnue2 : &g_nnue3);
-  const auto output =
-      color == Colors::White
-          ? screlu_flatten(m_curr->white, m_curr->black, ptr->output_v)
-          : screlu_flatten(m_curr->black, m_curr->white, ptr->output_v);
+  const auto &acc = accumulator(m_ply, Phase);
+  const Layer1 &us = position.color == Colors::White ? acc.white : acc.black;
+  const Layer1 &them = position.color == Colors::White ? acc.black : acc.white;
 
-  return (output + ptr->output_bias) * SCALE / QAB;
+  return evaluate_accumulator(g_nets[Phase], us, them,
+                              pop_count(position.colors_bb[Colors::White] |
+                                        position.colors_bb[Colors::Black]));
 }
 
-template <bool Activate>
-inline void NNUE_State::update_feature(int piece, int square, int phase) {
-  const auto [white_idx, black_idx] = feature_indices(piece, square);
-  const NNUE_Params *ptr =
-      (phase == PhaseTypes::Middlegame ? &g_nnue : phase == PhaseTypes::Endgame ? &g_nnue2 : &g_nnue3);
+template <int Phase>
+void NNUE_State::refresh_perspective(int16_t *output, int perspective,
+                                     const std::array<uint64_t, 2> &colors_bb,
+                                     const std::array<uint64_t, 7> &pieces_bb) {
+  // Rebuilds one perspective of an accumulator for Phase's net by diffing the
+  // board against the cached board for its king slot.
+
+  const Network &net = g_nets[Phase];
+  const int king_sq = king_square(colors_bb, pieces_bb, perspective);
+  const PerspectiveRows rows = net.perspective_rows(perspective, king_sq);
+
+  // Phases whose nets share a feature transformer share cache entries too.
+  RefreshEntry &entry =
+      m_refresh_table[m_phase_slot[Phase]][perspective]
+                     [net.king_slot(perspective, king_sq)];
+
+  if (entry.generation != g_net_generation) {
+    std::memcpy(entry.accumulator.data(), net.feature_bias->data(),
+                sizeof(entry.accumulator));
+    entry.colors_bb = {0}, entry.pieces_bb = {0};
+    entry.generation = g_net_generation;
+  }
 
-  if constexpr (Activate) {
-    add_to_all(m_curr->white, m_curr->white, ptr->feature_v,
-               white_idx * LAYER1_SIZE);
-    add_to_all(m_curr->black, m_curr->black, ptr->feature_v,
-               black_idx * LAYER1_SIZE);
-  } else {
-    subtract_from_all(m_curr->white, m_curr->white, ptr->feature_v,
-                      white_idx * LAYER1_SIZE);
-    subtract_from_all(m_curr->black, m_curr->black, ptr->feature_v,
-                      black_idx * LAYER1_SIZE);
+  std::array<const int16_t *, 32> adds, subs;
+  size_t num_adds = 0, num_subs = 0;
+
+  for (int color : {Colors::White, Colors::Black}) {
+    for (int type = PieceTypes::Pawn; type <= PieceTypes::King; type++) {
+
+      uint64_t cached = entry.colors_bb[color] & entry.pieces_bb[type];
+      uint64_t current = colors_bb[color] & pieces_bb[type];
+      int piece = type * 2 + color;
+
+      for (uint64_t added = current & ~cached; added;) {
+        adds[num_adds++] = rows.row(piece, pop_lsb(added));
+      }
+
+      for (uint64_t removed = cached & ~current; removed;) {
+        subs[num_subs++] = rows.row(piece, pop_lsb(removed));
+      }
+    }
   }
+
+  kernels().refresh(entry.accumulator.data(), entry.accumulator.data(),
+                    FeatureRowSpan(adds.data(), num_adds),
+                    FeatureRowSpan(subs.data(), num_subs));
+  m_rows_read += num_adds + num_subs;
+
+  entry.colors_bb = colors_bb, entry.pieces_bb = pieces_bb;
+
+  std::memcpy(output, entry.accumulator.data(), sizeof(entry.accumulator));
 }
 
-void NNUE_State::reset_nnue(const Position &position, int phase) {
+void NNUE_State::refresh(const Position &position, int phase) {
+  // Rebuilds the current accumulator (every net's, with all-phase
+  // accumulators) and records the kings it was built for.
+
+  AccumulatorUpdate &update = m_update_stack[m_ply];
 
-  m_curr = &m_accumulator_stack[0];
-  m_curr->init(phase == PhaseTypes::Middlegame ? g_nnue.feature_bias
-                                                  : phase == PhaseTypes::Endgame ? g_nnue2.feature_bias : g_nnue3.feature_bias);
+  for (int perspective : {Colors::White, Colors::Black}) {
+    update.king_squares[perspective] =
+        king_square(position.colors_bb, position.pieces_bb, perspective);
 
-  for (int square = a1; square < SqNone; square++) {
-    if (position.board[square] != Pieces::Blank) {
-      update_feature<true>(position.board[square], square, phase);
+    for (int i = 0; i < (m_all_phases ? m_num_slots : 1); i++) {
+      const int slot = m_all_phases ? m_slots[i] : 0;
+      auto &acc = m_accumulator_stacks[slot][m_ply];
+
+      with_phase(m_all_phases ? slot : phase, [&](auto phase) {
+        refresh_perspective<phase.value>(
+            perspective == Colors::White ? acc.white.data() : acc.black.data(),
+            perspective, position.colors_bb, position.pieces_bb);
+      });
     }
   }
 }
 
+void NNUE_State::reset_nnue(const Position &position, int phase) {
+
+  // The nets may have changed since the last search.
+  m_all_phases = g_all_phase_accumulators;
+  m_num_slots = 0;
+  for (int p = 0; p < 3; p++) {
+    m_phase_slot[p] = ft_slot(p);
+    if (m_phase_slot[p] == p) {
+      m_slots[m_num_slots++] = p;
+    }
+  }
+
+  m_ply = 0;
+  m_update_stack[0].phase = phase;
+  m_update_stack[0].computed = true;
+
+  refresh(position, phase);
+}
+
+bool NNUE_State::free_phase_switch(int from, int to) const {
+  // Whether the accumulators for phase from are also those of phase to.
+  return m_all_phases || shares_feature_transformer(from, to);
+}
+
 void NNUE_State::change_phases(const Position &position, int phase) {
+  // Pushes a ply for a phase switch that needs a refresh.
+
+  const auto start = std::chrono::steady_clock::now();
 
-  m_curr++;
-  m_curr->init(phase == PhaseTypes::Middlegame ? g_nnue.feature_bias
-                                                  : phase == PhaseTypes::Endgame ? g_nnue2.feature_bias : g_nnue3.feature_bias);
+  m_ply++;
+  m_update_stack[m_ply].phase = phase;
+  m_update_stack[m_ply].computed = true;
+
+  refresh(position, phase);
+
+  m_phase_switches++, m_phase_refreshes++;
+  m_phase_refresh_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+}
+
+void NNUE_State::switch_root_phase(const Position &position, int phase) {
+  // Changes the net the search uses between iterations. The root
+  // accumulator can be reused when it was built for the new net too.
+
+  if (free_phase_switch(m_update_stack[0].phase, phase)) {
+    m_ply = 0;
+    m_update_stack[0].phase = phase;
+    m_phase_switches++;
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  reset_nnue(position, phase);
+
+  m_phase_switches++, m_phase_refreshes++;
+  m_phase_refresh_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+}
+
+double measure_update_ns(int iterations = 1 << 18) {
+  // The cost of one incremental accumulator update (a quiet move, both
+  // perspectives) with random rows of the middlegame net. bench uses it to
+  // price the extra updates all-phase accumulators would do.
+
+  const Network &net = g_nets[PhaseTypes::Middlegame];
+  const size_t num_rows = size_t(net.input_buckets) * INPUT_SIZE;
+
+  std::mt19937 rng(0);
+  std::array<const int16_t *, 1024> rows;
+  for (auto &row : rows) {
+    row = &net.feature_v[(rng() % num_rows) * LAYER1_SIZE];
+  }
+
+  Accumulator<LAYER1_SIZE> acc;
+  acc.init(*net.feature_bias);
+
+  auto start = std::chrono::steady_clock::now();
+
+  // The first pass warms up the caches and is not counted.
+  for (int i = -iterations; i < iterations; i++) {
+    if (i == 0) {
+      start = std::chrono::steady_clock::now();
+    }
+    const FeatureRows<1> add = {rows[i & 1023]}, sub = {rows[(i + 7) & 1023]};
+    kernels().add_sub(acc.white.data(), acc.white.data(), add, sub);
+    kernels().add_sub(acc.black.data(), acc.black.data(), add, sub);
+  }
+
+  const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  // Keep the loop from being optimized out.
+  volatile int16_t sink = acc.white[0] + acc.black[0];
+  (void)sink;
+
+  return double(elapsed.count()) / iterations;
+}
+
+// Boards accumulated together by evaluate_batch. 32 of them (32 KB of
+// accumulators) stay in L1 while the feature rows stream past.
+constexpr size_t EVAL_BATCH_SIZE = 32;
+
+void evaluate_batch(std::span<const Position> positions, int phase,
+                    std::span<int> scores) {
+  // Scores many unrelated boards with one net, from the side to move's point
+  // of view. Instead of refreshing the boards one at a time, the features of
+  // a batch are bucketed by feature transformer row, and each row is then
+  // streamed once and added to every accumulator that has it.
+
+  const Network &net = g_nets[phase];
+  const size_t num_rows = size_t(net.input_buckets) * INPUT_SIZE;
+
+  std::vector<Accumulator<LAYER1_SIZE>> accumulators(EVAL_BATCH_SIZE);
+  std::vector<uint32_t> row_start(num_rows + 1);
+  std::vector<std::pair<uint32_t, int16_t *>> features;
+  std::vector<int16_t *> targets;
+  features.reserve(EVAL_BATCH_SIZE * 64);
+  targets.reserve(EVAL_BATCH_SIZE * 64);
+
+  for (size_t first = 0; first < positions.size(); first += EVAL_BATCH_SIZE) {
+    const size_t count = std::min(EVAL_BATCH_SIZE, positions.size() - first);
+
+    features.clear();
+    std::fill(row_start.begin(), row_start.end(), 0);
+
+    for (size_t n = 0; n < count; n++) {
+      const Position &position = positions[first + n];
+      accumulators[n].init(*net.feature_bias);
+
+      for (int perspective : {Colors::White, Colors::Black}) {
+        int16_t *output = perspective == Colors::White
+                              ? accumulators[n].white.data()
+                              : accumulators[n].black.data();
+        const PerspectiveRows rows = net.perspective_rows(
+            perspective, king_square(position.colors_bb, position.pieces_bb,
+                                     perspective));
+
+        for (int color : {Colors::White, Colors::Black}) {
+          for (int type = PieceTypes::Pawn; type <= PieceTypes::King;
+               type++) {
+            const int piece = type * 2 + color;
+            for (uint64_t bb = position.colors_bb[color] &
+                               position.pieces_bb[type];
+                 bb;) {
+              const uint32_t row =
+                  (rows.row(piece, pop_lsb(bb)) - net.feature_v) /
+                  LAYER1_SIZE;
+              features.push_back({row, output});
+              row_start[row + 1]++;
+            }
+          }
+        }
+      }
+    }
+
+    // Counting sort of the accumulators by row.
+    for (size_t row = 0; row < num_rows; row++) {
+      row_start[row + 1] += row_start[row];
+    }
+    targets.resize(features.size());
+    for (auto [row, output] : features) {
+      targets[row_start[row]++] = output;
+    }
+
+    // row_start[row] is now where the next row starts.
+    for (size_t row = 0, start = 0; row < num_rows; row++) {
+      if (row_start[row] != start) {
+        kernels().add_row_to_all(&net.feature_v[row * LAYER1_SIZE],
+                                 &targets[start], row_start[row] - start);
+        start = row_start[row];
+      }
+    }
 
-  for (int square = a1; square < SqNone; square++) {
-    if (position.board[square] != Pieces::Blank) {
-      update_feature<true>(position.board[square], square, phase);
+    for (size_t n = 0; n < count; n++) {
+      const Position &position = positions[first + n];
+      const auto &accumulator = accumulators[n];
+
+      scores[first + n] = evaluate_accumulator(
+          net,
+          position.color == Colors::White ? accumulator.white
+                                          : accumulator.black,
+          position.color == Colors::White ? accumulator.black
+                                          : accumulator.white,
+          pop_count(position.colors_bb[Colors::White] |
+                    position.colors_bb[Colors::Black]));
     }
   }
 }
@@ -0,0 +1,441 @@
+#pragma once
+#include "simd.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// The NNUE arithmetic kernels. This header is self contained so that a
+// dispatch build can compile it once per instruction set level (kernels.cpp);
+// nothing in it may need dynamic initialization, since that would run code
+// for a level the host might not support.
+
+constexpr size_t INPUT_SIZE = 768;
+constexpr size_t LAYER1_SIZE = 256;
+
+constexpr int SCRELU_MIN = 0;
+constexpr int SCRELU_MAX = 255;
+
+constexpr int SCALE = 400;
+
+constexpr int QA = 255;
+constexpr int QB = 64;
+
+constexpr int QAB = QA * QB;
+
+// Accumulator updates compute output = input + sum(adds) - sum(subs) over one
+// perspective, where each add/sub is a row of the feature transformer. The
+// rows are passed as a std::array when the count is known at compile time
+// (incremental updates) and as a std::span when it isn't (refreshes).
+
+template <size_t N> using FeatureRows = std::array<const int16_t *, N>;
+using FeatureRowSpan = std::span<const int16_t *const>;
+
+using Layer1 = std::array<int16_t, LAYER1_SIZE>;
+using OutputWeights = std::array<int16_t, LAYER1_SIZE * 2>;
+
+// Layered nets replace the single output layer with FT -> L1 -> L2 -> 1. The
+// clipped feature transformer output of both perspectives is packed to
+// uint8 (0..L1_INPUT_MAX, representing 0..1) and multiplied with int8 L1
+// weights (scaled by QL1); L2 and the output layer are small and run in
+// float. Both hidden layers use CReLU.
+//
+// The L1 weights are stored in blocks of four inputs, [input / 4][output][4],
+// so that one broadcast 32 bit block of inputs multiplies a contiguous run of
+// weights. Since many FT outputs are zero after clipping, L1 only visits the
+// blocks with a nonzero input.
+
+constexpr size_t L1_INPUTS = LAYER1_SIZE * 2;
+constexpr size_t L1_SIZE = 16;
+constexpr size_t L2_SIZE = 32;
+constexpr size_t L1_BLOCK = 4;
+constexpr size_t L1_BLOCKS = L1_INPUTS / L1_BLOCK;
+
+constexpr int L1_INPUT_SHIFT = 1; // 0..QA down to 0..127 for maddubs
+constexpr int L1_INPUT_MAX = QA >> L1_INPUT_SHIFT;
+constexpr int QL1 = 64;
+
+// One output bucket's layers, exactly as stored in a net file.
+struct alignas(64) LayerStack {
+  std::array<int8_t, L1_INPUTS * L1_SIZE> l1_weights;
+  std::array<int32_t, L1_SIZE> l1_bias;
+  std::array<float, L2_SIZE * L1_SIZE> l2_weights; // [L2_SIZE][L1_SIZE]
+  std::array<float, L2_SIZE> l2_bias;
+  std::array<float, L2_SIZE> output_weights;
+  float output_bias;
+};
+
+using L1Output = std::array<int32_t, L1_SIZE>;
+
+// One instruction set level's kernels. The incremental update shapes are
+// quiet moves (1 add, 1 sub), captures (1, 2) and castling (2, 2).
+struct NNUE_Kernels {
+  const char *name;
+  void (*add_sub)(int16_t *, const int16_t *, const FeatureRows<1> &,
+                  const FeatureRows<1> &);
+  void (*add_sub_sub)(int16_t *, const int16_t *, const FeatureRows<1> &,
+                      const FeatureRows<2> &);
+  void (*add_add_sub_sub)(int16_t *, const int16_t *, const FeatureRows<2> &,
+                          const FeatureRows<2> &);
+  void (*refresh)(int16_t *, const int16_t *, const FeatureRowSpan &,
+                  const FeatureRowSpan &);
+  void (*add_row_to_all)(const int16_t *, int16_t *const *, size_t);
+  int32_t (*screlu_flatten)(const Layer1 &, const Layer1 &,
+                            const OutputWeights &);
+  void (*l1_forward)(const Layer1 &, const Layer1 &, const LayerStack &,
+                     L1Output &);
+};
+
+namespace SIMD_ARCH {
+
+constexpr int32_t screlu(int16_t x) {
+  const int32_t clipped =
+      x < SCRELU_MIN ? SCRELU_MIN : x > SCRELU_MAX ? SCRELU_MAX : x;
+  return clipped * clipped;
+}
+
+template <typename AddRows, typename SubRows>
+inline void update_accumulator_scalar(int16_t *output, const int16_t *input,
+                                      const AddRows &adds,
+                                      const SubRows &subs) {
+  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
+    int16_t value = input[i];
+    for (const int16_t *row : adds) {
+      value += row[i];
+    }
+    for (const int16_t *row : subs) {
+      value -= row[i];
+    }
+    output[i] = value;
+  }
+}
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+
+// The SIMD kernels are register tiled: a chunk of the accumulator is loaded
+// once, every add and subtract row is applied to it while it stays in
+// registers, and only then is it written back. Half of the register file is
+// used for the tile so the weight rows can be streamed through the other half.
+constexpr size_t UPDATE_TILE_REGISTERS =
+    LAYER1_SIZE / REGISTER_SIZE < REGISTER_COUNT / 2 ? LAYER1_SIZE / REGISTER_SIZE
+                                                     : REGISTER_COUNT / 2;
+constexpr size_t UPDATE_TILE_SIZE = UPDATE_TILE_REGISTERS * REGISTER_SIZE;
+
+static_assert(LAYER1_SIZE % UPDATE_TILE_SIZE == 0);
+
+#endif
+
+template <typename AddRows, typename SubRows>
+inline void update_accumulator(int16_t *output, const int16_t *input,
+                               const AddRows &adds, const SubRows &subs) {
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+
+  for (size_t tile = 0; tile < LAYER1_SIZE; tile += UPDATE_TILE_SIZE) {
+    vec_int16 regs[UPDATE_TILE_REGISTERS];
+
+    for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+      regs[r] = int16_load(&input[tile + r * REGISTER_SIZE]);
+    }
+
+    for (const int16_t *row : adds) {
+      for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+        regs[r] =
+            vec_int16_add(regs[r], int16_load(&row[tile + r * REGISTER_SIZE]));
+      }
+    }
+
+    for (const int16_t *row : subs) {
+      for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+        regs[r] =
+            vec_int16_sub(regs[r], int16_load(&row[tile + r * REGISTER_SIZE]));
+      }
+    }
+
+    for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+      int16_store(&output[tile + r * REGISTER_SIZE], regs[r]);
+    }
+  }
+
+#else
+
+  update_accumulator_scalar(output, input, adds, subs);
+
+#endif
+}
+
+inline void add_row_to_all_scalar(const int16_t *row,
+                                  int16_t *const *accumulators, size_t count) {
+  for (size_t n = 0; n < count; n++) {
+    for (size_t i = 0; i < LAYER1_SIZE; ++i) {
+      accumulators[n][i] += row[i];
+    }
+  }
+}
+
+inline void add_row_to_all(const int16_t *row, int16_t *const *accumulators,
+                           size_t count) {
+  // The batched evaluator's kernel: one feature row is added to every
+  // accumulator that has the feature, so the row is read from memory once
+  // and stays in registers across all of them.
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+
+  for (size_t tile = 0; tile < LAYER1_SIZE; tile += UPDATE_TILE_SIZE) {
+    vec_int16 regs[UPDATE_TILE_REGISTERS];
+
+    for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+      regs[r] = int16_load(&row[tile + r * REGISTER_SIZE]);
+    }
+
+    for (size_t n = 0; n < count; n++) {
+      int16_t *accumulator = accumulators[n] + tile;
+      for (size_t r = 0; r < UPDATE_TILE_REGISTERS; r++) {
+        int16_store(&accumulator[r * REGISTER_SIZE],
+                    vec_int16_add(regs[r], int16_load(
+                                               &accumulator[r * REGISTER_SIZE])));
+      }
+    }
+  }
+
+#else
+
+  add_row_to_all_scalar(row, accumulators, count);
+
+#endif
+}
+
+inline int32_t screlu_flatten_scalar(const Layer1 &us, const Layer1 &them,
+                                     const OutputWeights &weights) {
+  int32_t sum = 0;
+
+  for (size_t i = 0; i < LAYER1_SIZE; ++i) {
+    sum += screlu(us[i]) * weights[i];
+    sum += screlu(them[i]) * weights[LAYER1_SIZE + i];
+  }
+
+  return sum / QA;
+}
+
+inline int32_t screlu_flatten(const Layer1 &us, const Layer1 &them,
+                              const OutputWeights &weights) {
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+
+  const auto min_vec = get_int16_vec(SCRELU_MIN);
+  const auto max_vec = get_int16_vec(QA);
+
+  auto sum = vec_int32_zero();
+
+  for (size_t i = 0; i < LAYER1_SIZE; i += REGISTER_SIZE) {
+
+    auto v_us = int16_load(&us[i]);
+    auto w_us = int16_load(&weights[i]);
+
+    v_us = vec_int16_clamp(v_us, min_vec, max_vec);
+
+    auto our_product = vec_int16_multiply(v_us, w_us);
+
+    auto our_result = vec_int16_madd_int32(our_product, v_us);
+
+    sum = vec_int32_add(sum, our_result);
+
+    auto v_them = int16_load(&them[i]);
+    auto w_them = int16_load(&weights[LAYER1_SIZE + i]);
+
+    v_them = vec_int16_clamp(v_them, min_vec, max_vec);
+
+    auto their_product = vec_int16_multiply(v_them, w_them);
+
+    auto their_result = vec_int16_madd_int32(their_product, v_them);
+
+    sum = vec_int32_add(sum, their_result);
+  }
+
+  return vec_int32_hadd(sum) / QA;
+
+#else
+
+  return screlu_flatten_scalar(us, them, weights);
+
+#endif
+}
+
+inline uint8_t l1_input(int16_t x) {
+  return (x < 0 ? 0 : x > QA ? QA : x) >> L1_INPUT_SHIFT;
+}
+
+inline void l1_forward_dense(const Layer1 &us, const Layer1 &them,
+                             const LayerStack &stack, L1Output &output) {
+  // The reference: every input times every weight.
+  for (size_t out = 0; out < L1_SIZE; out++) {
+    int32_t sum = stack.l1_bias[out];
+    for (size_t i = 0; i < L1_INPUTS; i++) {
+      const int16_t x = i < LAYER1_SIZE ? us[i] : them[i - LAYER1_SIZE];
+      const size_t block = i / L1_BLOCK, lane = i % L1_BLOCK;
+      sum += l1_input(x) *
+             stack.l1_weights[(block * L1_SIZE + out) * L1_BLOCK + lane];
+    }
+    output[out] = sum;
+  }
+}
+
+inline void l1_forward(const Layer1 &us, const Layer1 &them,
+                       const LayerStack &stack, L1Output &output) {
+
+  alignas(64) uint8_t input[L1_INPUTS];
+  uint16_t nonzero[L1_BLOCKS];
+  size_t count = 0;
+
+#if defined(__AVX512BW__) || defined(__AVX2__)
+
+  // Clip and pack the FT output to uint8, then record which 32 bit blocks of
+  // it are nonzero.
+#if defined(__AVX512BW__)
+  using vec = __m512i;
+  const vec lanes = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+  auto pack = [&](vec a, vec b) {
+    return _mm512_permutexvar_epi64(lanes, _mm512_packus_epi16(a, b));
+  };
+  auto nonzero_mask = [](vec v) -> uint32_t {
+    return _mm512_test_epi32_mask(v, v);
+  };
+#else
+  using vec = __m256i;
+  auto pack = [](vec a, vec b) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0b11011000);
+  };
+  auto nonzero_mask = [](vec v) -> uint32_t {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(v, _mm256_setzero_si256())));
+  };
+#endif
+  constexpr size_t lanes16 = sizeof(vec) / sizeof(int16_t);
+
+  const auto zero = get_int16_vec(0);
+  const auto max = get_int16_vec(QA);
+
+  for (size_t i = 0; i < L1_INPUTS; i += lanes16 * 2) {
+    const int16_t *src =
+        i < LAYER1_SIZE ? &us[i] : &them[i - LAYER1_SIZE];
+
+    auto a = vec_int16_clamp(int16_load(src), zero, max);
+    auto b = vec_int16_clamp(int16_load(src + lanes16), zero, max);
+    a = vec_int16_shift_right(a, L1_INPUT_SHIFT);
+    b = vec_int16_shift_right(b, L1_INPUT_SHIFT);
+
+    const vec packed = pack(a, b);
+    int16_store(&input[i], packed);
+
+    // Packed bytes are at most 127, so a nonzero block is a positive int32.
+    for (uint32_t mask = nonzero_mask(packed); mask; mask &= mask - 1) {
+      nonzero[count++] = i / L1_BLOCK + __builtin_ctz(mask);
+    }
+  }
+
+  // Multiply-accumulate the nonzero blocks. Each block's inputs are
+  // broadcast against the L1_SIZE x 4 weights for it.
+  const int32_t *blocks = reinterpret_cast<const int32_t *>(input);
+  const int8_t *weights = stack.l1_weights.data();
+
+#if defined(__AVX512BW__)
+  static_assert(L1_SIZE * L1_BLOCK == sizeof(__m512i));
+
+  __m512i sum = _mm512_load_si512(stack.l1_bias.data());
+#if !defined(__AVX512VNNI__)
+  const __m512i ones = _mm512_set1_epi16(1);
+#endif
+
+  for (size_t n = 0; n < count; n++) {
+    const __m512i x = _mm512_set1_epi32(blocks[nonzero[n]]);
+    const __m512i w =
+        _mm512_load_si512(&weights[nonzero[n] * L1_SIZE * L1_BLOCK]);
+#if defined(__AVX512VNNI__)
+    sum = _mm512_dpbusd_epi32(sum, x, w);
+#else
+    sum = _mm512_add_epi32(
+        sum, _mm512_madd_epi16(_mm512_maddubs_epi16(x, w), ones));
+#endif
+  }
+
+  _mm512_storeu_si512(output.data(), sum);
+
+#else
+  static_assert(L1_SIZE * L1_BLOCK == 2 * sizeof(__m256i));
+
+  __m256i sum0 = _mm256_load_si256(
+      reinterpret_cast<const __m256i *>(&stack.l1_bias[0]));
+  __m256i sum1 = _mm256_load_si256(
+      reinterpret_cast<const __m256i *>(&stack.l1_bias[L1_SIZE / 2]));
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  for (size_t n = 0; n < count; n++) {
+    const __m256i x = _mm256_set1_epi32(blocks[nonzero[n]]);
+    const auto *w = reinterpret_cast<const __m256i *>(
+        &weights[nonzero[n] * L1_SIZE * L1_BLOCK]);
+    sum0 = _mm256_add_epi32(
+        sum0, _mm256_madd_epi16(
+                  _mm256_maddubs_epi16(x, _mm256_load_si256(w)), ones));
+    sum1 = _mm256_add_epi32(
+        sum1, _mm256_madd_epi16(
+                  _mm256_maddubs_epi16(x, _mm256_load_si256(w + 1)), ones));
+  }
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(&output[0]), sum0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(&output[L1_SIZE / 2]),
+                      sum1);
+#endif
+
+#else
+
+  // Without AVX2 the same sparse walk is done in scalar code.
+  for (size_t i = 0; i < L1_INPUTS; i++) {
+    input[i] = l1_input(i < LAYER1_SIZE ? us[i] : them[i - LAYER1_SIZE]);
+  }
+  for (size_t block = 0; block < L1_BLOCKS; block++) {
+    const uint8_t *x = &input[block * L1_BLOCK];
+    if (x[0] | x[1] | x[2] | x[3]) {
+      nonzero[count++] = block;
+    }
+  }
+
+  for (size_t out = 0; out < L1_SIZE; out++) {
+    output[out] = stack.l1_bias[out];
+  }
+  for (size_t n = 0; n < count; n++) {
+    const uint8_t *x = &input[nonzero[n] * L1_BLOCK];
+    const int8_t *w = &stack.l1_weights[nonzero[n] * L1_SIZE * L1_BLOCK];
+    for (size_t out = 0; out < L1_SIZE; out++) {
+      for (size_t lane = 0; lane < L1_BLOCK; lane++) {
+        output[out] += x[lane] * w[out * L1_BLOCK + lane];
+      }
+    }
+  }
+
+#endif
+}
+
+constexpr NNUE_Kernels kernel_table = {
+    SIMD_NAME,
+    update_accumulator<FeatureRows<1>, FeatureRows<1>>,
+    update_accumulator<FeatureRows<1>, FeatureRows<2>>,
+    update_accumulator<FeatureRows<2>, FeatureRows<2>>,
+    update_accumulator<FeatureRowSpan, FeatureRowSpan>,
+    add_row_to_all,
+    screlu_flatten,
+    l1_forward,
+};
+
+// The reference the SIMD kernels are checked against (see test_kernels).
+constexpr NNUE_Kernels scalar_kernel_table = {
+    "scalar",
+    update_accumulator_scalar<FeatureRows<1>, FeatureRows<1>>,
+    update_accumulator_scalar<FeatureRows<1>, FeatureRows<2>>,
+    update_accumulator_scalar<FeatureRows<2>, FeatureRows<2>>,
+    update_accumulator_scalar<FeatureRowSpan, FeatureRowSpan>,
+    add_row_to_all_scalar,
+    screlu_flatten_scalar,
+    l1_forward_dense,
+};
+
+} // namespace SIMD_ARCH
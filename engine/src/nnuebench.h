@@ -0,0 +1,218 @@
+#pragma once
+#include "search.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Micro-benchmarks of the NNUE operations the search performs, over the
+// bench positions and every legal move from them. Incremental updates are
+// timed including the lazy update being applied and popped again, so each
+// op is the full cost a searched node pays for it. change_phases is only
+// timed when the middlegame and endgame nets have different feature
+// transformers; otherwise search never refreshes on a phase switch.
+
+struct NNUEBenchMove {
+  Move move;
+  Position moved_position;
+};
+
+struct NNUEBenchRoot {
+  Position position;
+  std::vector<NNUEBenchMove> quiets;   // add_sub
+  std::vector<NNUEBenchMove> captures; // add_sub_sub
+  std::vector<NNUEBenchMove> castles;  // add_add_sub_sub
+};
+
+struct NNUEBenchResult {
+  const char *op;
+  uint64_t ops = 0;
+  int64_t ns = 0;
+  uint64_t weight_bytes = 0;
+};
+
+std::vector<NNUEBenchRoot> nnuebench_corpus(const std::vector<std::string> &fens,
+                                            ThreadInfo &thread_info) {
+  std::vector<NNUEBenchRoot> roots;
+
+  for (const std::string &fen : fens) {
+    NNUEBenchRoot &root = roots.emplace_back();
+    set_board(root.position, thread_info, fen);
+
+    const Position &position = root.position;
+    std::array<Move, ListSize> list;
+    int nmoves = movegen(
+        position, list,
+        attacks_square(position, get_king_pos(position, position.color),
+                       position.color ^ 1),
+        Generate::GenAll);
+
+    for (int i = 0; i < nmoves; i++) {
+      if (!is_legal(position, list[i])) {
+        continue;
+      }
+
+      NNUEBenchMove entry = {list[i], position};
+      make_move(entry.moved_position, list[i]);
+
+      if (extract_type(list[i]) == MoveTypes::Castling) {
+        root.castles.push_back(entry);
+      } else if (is_cap(position, list[i])) {
+        root.captures.push_back(entry);
+      } else {
+        root.quiets.push_back(entry);
+      }
+    }
+  }
+
+  return roots;
+}
+
+void nnuebench(const std::vector<std::string> &fens, const std::string &format,
+               int iterations = 1000) {
+  std::unique_ptr<ThreadInfo> owned = std::make_unique<ThreadInfo>();
+  ThreadInfo &thread_info = *owned;
+  NNUE_State &nnue = thread_info.nnue_state;
+
+  const std::vector<NNUEBenchRoot> roots = nnuebench_corpus(fens, thread_info);
+
+  // The endgame net is used throughout so that captures never switch phase,
+  // except for change_phases, which switches to the middlegame net and back.
+  thread_info.phase = PhaseTypes::Endgame;
+
+  NNUEBenchResult add_sub = {"add_sub"}, add_sub_sub = {"add_sub_sub"},
+                  add_add_sub_sub = {"add_add_sub_sub"},
+                  change_phases = {"change_phases"}, reset = {"reset_nnue"},
+                  evaluate = {"evaluate"};
+
+  const bool phase_switch_free =
+      nnue.free_phase_switch(PhaseTypes::Middlegame, PhaseTypes::Endgame);
+
+  // There are only a couple of castling moves per position, so they're
+  // repeated to time more than the clock's overhead.
+  constexpr int CASTLE_REPEATS = 32;
+
+  auto time_moves = [&](const NNUEBenchRoot &root,
+                        const std::vector<NNUEBenchMove> &moves,
+                        NNUEBenchResult &result, int repeats = 1) {
+    const uint64_t rows = nnue.m_rows_read;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int r = 0; r < repeats; r++) {
+      for (const NNUEBenchMove &entry : moves) {
+        update_nnue_state(thread_info, entry.move, root.position,
+                          entry.moved_position);
+        nnue.apply_updates();
+        nnue.pop();
+      }
+    }
+
+    result.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    result.ops += moves.size() * repeats;
+    result.weight_bytes += (nnue.m_rows_read - rows) * sizeof(Layer1);
+  };
+
+  int volatile sink = 0;
+
+  for (int i = 0; i < iterations; i++) {
+    for (const NNUEBenchRoot &root : roots) {
+      nnue.reset_nnue(root.position, PhaseTypes::Endgame);
+
+      time_moves(root, root.quiets, add_sub);
+      time_moves(root, root.captures, add_sub_sub);
+      time_moves(root, root.castles, add_add_sub_sub, CASTLE_REPEATS);
+
+      // Phase switches refresh from the cached board of the other phase's
+      // net, as they do in search.
+      if (!phase_switch_free) {
+        const uint64_t rows = nnue.m_rows_read;
+        const auto start = std::chrono::steady_clock::now();
+        for (int phase : {PhaseTypes::Middlegame, PhaseTypes::Endgame}) {
+          nnue.change_phases(root.position, phase);
+          nnue.pop();
+        }
+        change_phases.ns +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        change_phases.ops += 2;
+        change_phases.weight_bytes +=
+            (nnue.m_rows_read - rows) * sizeof(Layer1);
+      }
+
+      // The accumulator is already computed, so this is the output layers.
+      constexpr int EVALUATIONS = 32;
+      const auto start = std::chrono::steady_clock::now();
+      for (int n = 0; n < EVALUATIONS; n++) {
+        sink = sink + nnue.evaluate(root.position, PhaseTypes::Endgame);
+      }
+      evaluate.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+      evaluate.ops += EVALUATIONS;
+    }
+
+    // Resets run over the roots in turn, so each one refreshes from the
+    // previous board cached for its king bucket.
+    const uint64_t rows = nnue.m_rows_read;
+    const auto start = std::chrono::steady_clock::now();
+    for (const NNUEBenchRoot &root : roots) {
+      nnue.reset_nnue(root.position, PhaseTypes::Endgame);
+    }
+    reset.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    reset.ops += roots.size();
+    reset.weight_bytes += (nnue.m_rows_read - rows) * sizeof(Layer1);
+  }
+
+  // The output layers read a fixed amount per evaluation (for layered nets
+  // this is an upper bound, since L1 skips zero inputs).
+  const Network &net = g_nets[PhaseTypes::Endgame];
+  evaluate.weight_bytes =
+      evaluate.ops * (net.layers ? sizeof(LayerStack)
+                                 : sizeof(OutputWeights) + sizeof(int16_t));
+
+  std::vector<NNUEBenchResult> results = {add_sub, add_sub_sub,
+                                          add_add_sub_sub};
+  if (!phase_switch_free) {
+    results.push_back(change_phases);
+  }
+  results.push_back(reset);
+  results.push_back(evaluate);
+
+  auto ns_per_op = [](const NNUEBenchResult &r) {
+    return r.ops ? double(r.ns) / r.ops : 0.0;
+  };
+  auto ops_per_sec = [](const NNUEBenchResult &r) {
+    return r.ns ? r.ops * 1e9 / r.ns : 0.0;
+  };
+  auto bytes_per_op = [](const NNUEBenchResult &r) {
+    return r.ops ? double(r.weight_bytes) / r.ops : 0.0;
+  };
+
+  if (format == "csv") {
+    printf("op,ops,ns_per_op,ops_per_sec,weight_bytes_per_op,kernels\n");
+    for (const NNUEBenchResult &r : results) {
+      printf("%s,%" PRIu64 ",%.2f,%.0f,%.1f,%s\n", r.op, r.ops, ns_per_op(r),
+             ops_per_sec(r), bytes_per_op(r), kernels().name);
+    }
+    return;
+  }
+
+  printf("{\n  \"cpu_level\": \"%s\",\n  \"kernels\": \"%s\",\n"
+         "  \"positions\": %zu,\n  \"free_phase_switch\": %s,\n"
+         "  \"results\": [\n",
+         CpuLevelNames[g_cpu_level], kernels().name, roots.size(),
+         phase_switch_free ? "true" : "false");
+  for (size_t i = 0; i < results.size(); i++) {
+    const NNUEBenchResult &r = results[i];
+    printf("    {\"op\": \"%s\", \"ops\": %" PRIu64
+           ", \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, "
+           "\"weight_bytes_per_op\": %.1f}%s\n",
+           r.op, r.ops, ns_per_op(r), ops_per_sec(r), bytes_per_op(r),
+           i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
@@ -60,6 +60,7 @@ TUNE_PARAM(AspStartWindow, 20, 10, 30);
 TUNE_PARAM(NodeTmFactor1, 149, 100, 200);
 TUNE_PARAM(NodeTmFactor2, 177, 125, 225);
 TUNE_PARAM(BmFactor1, 152, 100, 200);
+TUNE_PARAM(ScoreTmFactor, 50, 0, 100);
 
 
 void print_params_for_ob() {
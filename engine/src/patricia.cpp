@@ -15,6 +15,24 @@ int main(int argc, char *argv[]) {
       bench(position, *thread_info);
       std::exit(0);
     }
+    else if (std::string(argv[1]) == "simdtest") {
+      std::exit(test_kernels() ? 0 : 1);
+    }
+    else if (std::string(argv[1]) == "nnuebench") {
+      nnuebench(bench_fens, argc > 2 ? argv[2] : "json");
+      std::exit(0);
+    }
+    else if (std::string(argv[1]) == "smpbench") {
+      int depth = argc > 2 ? std::atoi(argv[2]) : 10;
+      int threads = argc > 3 ? std::atoi(argv[3])
+                             : std::max<int>(std::thread::hardware_concurrency(), 1);
+      smpbench(position, *thread_info, bench_fens, depth, threads);
+      std::exit(0);
+    }
+    else if (std::string(argv[1]) == "evalbatch" && argc > 2) {
+      evalbatch(argv[2], PhaseTypes::Middlegame);
+      std::exit(0);
+    }
     else if (std::string(argv[1]) == "perft"){
       set_board(position, *thread_info, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
       perft(std::atoi(argv[2]), position, true, *thread_info);
@@ -259,6 +259,18 @@ void set_board(Position &position, ThreadInfo &thread_info,
   position.halfmoves = halfmoves;
 }
 
+void set_board_pieces(Position &position, std::string_view fen) {
+  // Sets only the pieces and side to move of a fen, which is all the
+  // evaluator needs. Used when scoring large files of positions.
+  generate_bb(fen, position);
+
+  const size_t color = fen.find(' ');
+  position.color = color != std::string_view::npos && color + 1 < fen.size() &&
+                           fen[color + 1] == 'b'
+                       ? Colors::Black
+                       : Colors::White;
+}
+
 std::string export_fen(const Position &position,
                        const ThreadInfo &thread_info) {
 
@@ -506,13 +518,13 @@ void update_nnue_state(ThreadInfo &thread_info, Move move,
     if (side) {
       to = indx + 6;
       thread_info.nnue_state.add_add_sub_sub(
-          from_piece, from, to, Pieces::WRook + color,
+          moved_position, from_piece, from, to, Pieces::WRook + color,
           position.castling_squares[color][side], indx + 5, phase);
 
     } else {
       to = indx + 2;
       thread_info.nnue_state.add_add_sub_sub(
-          from_piece, from, to, Pieces::WRook + color,
+          moved_position, from_piece, from, to, Pieces::WRook + color,
           position.castling_squares[color][side], indx + 3, phase);
     }
   }
@@ -523,21 +535,33 @@ void update_nnue_state(ThreadInfo &thread_info, Move move,
         total_mat(position) - MaterialValues[get_piece_type(captured_piece)] <
             PhaseBound) {
 
-      thread_info.nnue_state.change_phases(moved_position, PhaseTypes::Endgame);
+      // When the endgame net shares the middlegame net's feature transformer
+      // (or all-phase accumulators keep both) only the output layer changes,
+      // so the capture stays incremental.
+      if (thread_info.nnue_state.free_phase_switch(PhaseTypes::Middlegame,
+                                                   PhaseTypes::Endgame)) {
+        thread_info.nnue_state.add_sub_sub(
+            moved_position, from_piece, from, to_piece, to, captured_piece,
+            captured_square, PhaseTypes::Endgame);
+      } else {
+        thread_info.nnue_state.change_phases(moved_position,
+                                             PhaseTypes::Endgame);
+      }
 
       thread_info.phase = PhaseTypes::Endgame;
 
     }
 
     else {
-      thread_info.nnue_state.add_sub_sub(from_piece, from, to_piece, to,
-                                         captured_piece, captured_square,
-                                         phase);
+      thread_info.nnue_state.add_sub_sub(moved_position, from_piece, from,
+                                         to_piece, to, captured_piece,
+                                         captured_square, phase);
     }
   }
 
   else {
-    thread_info.nnue_state.add_sub(from_piece, from, to_piece, to, phase);
+    thread_info.nnue_state.add_sub(moved_position, from_piece, from, to_piece,
+                                   to, phase);
   }
 }
 
@@ -15,22 +15,37 @@ void update_corrhist(int16_t &entry, int score) { // Update history score
   entry += score - entry * abs(score) / 1024;
 }
 
+void arm_search_timer(const ThreadInfo &thread_info) {
+  // The timer takes over once the first iteration is done, so that there's
+  // always a move to play.
+  if (!thread_info.doing_datagen && !thread_info.ponder &&
+      thread_info.max_time < INT32_MAX / 3) {
+    search_timer.arm(thread_info.start_time +
+                     std::chrono::milliseconds(thread_info.max_time));
+  }
+}
+
+void check_ponderhit(ThreadInfo &thread_info) {
+  // After ponderhit the search carries on, TT and histories intact, under
+  // the time limits of the go command.
+  if (thread_info.ponder && !thread_data.pondering) {
+    thread_info.ponder = false;
+    thread_info.start_time = std::chrono::steady_clock::now();
+    thread_info.max_time = thread_info.ponder_max_time;
+    thread_info.opt_time = thread_info.ponder_opt_time;
+    thread_info.original_opt = thread_info.ponder_opt_time;
+    arm_search_timer(thread_info);
+  }
+}
+
 bool out_of_time(ThreadInfo &thread_info) {
+  // The time limit is enforced by search_timer, which sets thread_data.stop.
   if (thread_data.stop || thread_info.datagen_stop) {
     return true;
   } else if (thread_info.thread_id != 0 || thread_info.current_iter == 1) {
     return false;
   }
   if (thread_info.nodes >= thread_info.max_nodes_searched) {
-
-    if (thread_info.max_time < INT32_MAX / 3) {
-
-      std::this_thread::sleep_for(std::chrono::milliseconds(
-          thread_info.opt_time - time_elapsed(thread_info.start_time)));
-      // If there's a max time limit and a node limit, it means we're using a
-      // skill level. In that case, we don't want the engine to move instantly.
-    }
-
     if (thread_info.doing_datagen) {
       thread_info.datagen_stop = true;
     } else {
@@ -38,13 +53,9 @@ bool out_of_time(ThreadInfo &thread_info) {
     }
     return true;
   }
-  thread_info.time_checks++;
-  if (thread_info.time_checks == 1024) {
+  if (thread_info.ponder && ++thread_info.time_checks == 1024) {
     thread_info.time_checks = 0;
-    if (time_elapsed(thread_info.start_time) > thread_info.max_time) {
-      thread_data.stop = true;
-      return true;
-    }
+    check_ponderhit(thread_info);
   }
   return false;
 }
@@ -77,10 +88,38 @@ int16_t total_mat_color(const Position &position, int color) {
   return m;
 }
 
+int nnue_eval(const Position &position, ThreadInfo &thread_info) {
+  // The raw NNUE output, through the thread's eval cache. The adjustments
+  // eval() makes on top of it depend on the search path, so they aren't
+  // cached. A hit also saves materializing the lazy accumulator updates.
+
+  EvalCache &cache = thread_info.eval_cache;
+
+  if (cache.entries.empty()) {
+    return thread_info.nnue_state.evaluate(position, thread_info.phase);
+  }
+
+  const uint32_t key = static_cast<uint32_t>(position.zobrist_key) ^
+                       (thread_info.phase * 0x9E3779B9u);
+  EvalCacheEntry &entry =
+      cache.entries[(uint128_t(position.zobrist_key) * cache.entries.size()) >>
+                    64];
+
+  cache.probes++;
+  if (entry.key == key) {
+    cache.hits++;
+    return entry.eval;
+  }
+
+  entry.key = key;
+  entry.eval = thread_info.nnue_state.evaluate(position, thread_info.phase);
+  return entry.eval;
+}
+
 int eval(Position &position, ThreadInfo &thread_info) {
   int color = position.color;
   int root_color = thread_info.search_ply % 2 ? color ^ 1 : color;
-  int eval = thread_info.nnue_state.evaluate(color, thread_info.phase);
+  int eval = nnue_eval(position, thread_info);
 
   // Patricia is much less dependent on explicit eval twiddling than before, but
   // there are still a few things I do.
@@ -252,15 +291,17 @@ int qsearch(int alpha, int beta, Position &position, ThreadInfo &thread_info,
                                          // given position.
   if (out_of_time(thread_info)) {
     // return if out of time
-    return correct_eval(
-        position, thread_info,
-        thread_info.nnue_state.evaluate(position.color, thread_info.phase));
+    return correct_eval(position, thread_info,
+                        nnue_eval(position, thread_info));
   }
   int color = position.color;
 
   GameHistory *ss = &(thread_info.game_hist[thread_info.game_ply]);
 
   thread_info.nodes++;
+  if (g_unique_nodes) {
+    count_unique_node(thread_info, position.zobrist_key);
+  }
 
   int ply = thread_info.search_ply;
 
@@ -443,6 +484,9 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
                    TT); // drop into qsearch if depth is too low.
   }
   thread_info.nodes++;
+  if (g_unique_nodes) {
+    count_unique_node(thread_info, position.zobrist_key);
+  }
 
   bool root = !ply, color = position.color, raised_alpha = false;
 
@@ -643,17 +687,45 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
   int best_score = ScoreNone, moves_played = 0; // Generate and score moves
   bool is_capture = false, skip = false;
 
-  while (Move move = next_move(picker, position, thread_info, tt_move, skip)) {
+  // Moves left for later because another thread is searching them (ABDADA).
+  // They're searched once the picker runs out, with the extension they got
+  // and without going through pruning again, since they already passed it.
+  AbdadaMark abdada_mark(position.zobrist_key,
+                         root || singular_search ? 0 : depth,
+                         thread_info.thread_id);
+  Move deferred_moves[ListSize];
+  int8_t deferred_extensions[ListSize];
+  int num_deferred = 0, deferred_index = 0;
+  bool picker_done = false;
+
+  // MultiPV roots walk the root move table, which holds the moves not yet
+  // ranked this iteration in the order of the last one.
+  const bool root_table = root && thread_info.multipv > 1;
+  size_t root_index = thread_info.multipv_index;
 
-    if (root) {
-      bool pv_skip = false;
-      for (int i = 0; i < thread_info.multipv_index; i++) {
-        if (thread_info.best_moves[i] == move) {
-          pv_skip = true;
-          break;
-        }
+  while (true) {
+    Move move = MoveNone;
+    bool replay = false;
+    if (root_table) {
+      if (root_index == thread_info.root_moves.size()) {
+        break;
+      }
+      move = thread_info.root_moves[root_index++].move;
+    } else if (!picker_done) {
+      move = next_move(picker, position, thread_info, tt_move, skip);
+      picker_done = move == MoveNone;
+    }
+    if (picker_done) {
+      if (deferred_index == num_deferred) {
+        break;
       }
-      if (pv_skip) {
+      move = deferred_moves[deferred_index++];
+      replay = true;
+    }
+
+    if (root) {
+      // Moves left out by go searchmoves
+      if (!find_root_move(thread_info, move)) {
         continue;
       }
     }
@@ -672,13 +744,14 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
                                  [extract_to(move)];
 
     is_capture = is_cap(position, move);
-    if (!is_capture && !is_pv && best_score > -MateScore) {
+    if (!replay && !is_capture && !is_pv && best_score > -MateScore) {
 
       // Late Move Pruning (LMP): If we've searched enough moves, we can skip
-      // the rest.
+      // the rest. Deferred moves count as searched, as they will be.
 
       if (depth < LMPDepth &&
-          moves_played >= LMPBase + depth * depth / (2 - improving)) {
+          moves_played + num_deferred >=
+              LMPBase + depth * depth / (2 - improving)) {
         skip = true;
       }
 
@@ -695,7 +768,8 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
       }
     }
 
-    if (!root && best_score > -MateScore && depth < SeePruningDepth) {
+    if (!replay && !root && best_score > -MateScore &&
+        depth < SeePruningDepth) {
 
       int margin =
           is_capture ? SeePruningQuietMargin : (depth * SeePruningNoisyMargin);
@@ -707,12 +781,12 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
       }
     }
 
-    int extension = 0;
+    int extension = replay ? deferred_extensions[deferred_index - 1] : 0;
 
     // Singular Extensions (SE): If a search finds that the TT move is way
     // better than all other moves, extend it under certain conditions.
 
-    if (!root && ply < thread_info.current_iter * 2) {
+    if (!replay && !root && ply < thread_info.current_iter * 2) {
       if (!singular_search && depth >= SEDepth && move == tt_move &&
           abs(entry.score) < MateScore && entry.depth >= depth - 3 &&
           entry_type != EntryTypes::UBound) {
@@ -745,6 +819,22 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
     Position moved_position = position;
     make_move(moved_position, move);
 
+    // ABDADA: at non-PV nodes, leave a move for later if another thread is
+    // already searching it at least as deep as we likely would.
+    if (g_abdada && !is_pv && moves_played && !picker_done) {
+      int child_depth = depth - 1 + extension;
+      if (depth >= LMRMinDepth) {
+        child_depth -= LMRTable[depth][moves_played];
+      }
+      if (child_depth >= AbdadaMinDepth &&
+          abdada_busy(moved_position.zobrist_key, child_depth,
+                      thread_info.thread_id)) {
+        deferred_moves[num_deferred] = move;
+        deferred_extensions[num_deferred++] = extension;
+        continue;
+      }
+    }
+
     update_nnue_state(thread_info, move, position, moved_position);
 
     ss_push(position, thread_info, move);
@@ -816,8 +906,24 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
     }
 
     if (root) {
-      find_root_move(thread_info, move)->nodes +=
-          (thread_info.nodes - curr_nodes);
+      RootMoveInfo *root_move = find_root_move(thread_info, move);
+      root_move->nodes += (thread_info.nodes - curr_nodes);
+
+      // Only scores inside the window are exact, and only those are kept,
+      // along with their PV. The rest are bounds and are left unranked.
+      if (score > alpha && score < beta) {
+        root_move->score = score;
+        root_move->seldepth = thread_info.seldepth;
+        root_move->pv[0] = move;
+        for (int n = 1; n < MaxSearchDepth; n++) {
+          root_move->pv[n] = thread_info.pv[MaxSearchDepth + n - 1];
+          if (root_move->pv[n] == MoveNone) {
+            break;
+          }
+        }
+      } else {
+        root_move->score = ScoreNone;
+      }
     }
 
     if (score > best_score) {
@@ -972,19 +1078,24 @@ int search(int alpha, int beta, int depth, bool cutnode, Position &position,
   return best_score;
 }
 
-void print_pv(Position &position, ThreadInfo &thread_info) {
+void print_pv(Position &position, ThreadInfo &thread_info,
+              const Move *pv = nullptr) {
   Position temp_pos = position;
 
+  if (!pv) {
+    pv = thread_info.pv.data();
+  }
+
   int indx = 0;
 
-  while (thread_info.pv[indx] != MoveNone) {
+  while (indx < MaxSearchDepth && pv[indx] != MoveNone) {
 
     if (indx == 3 && thread_info.is_human) {
       thread_info.pv_material[thread_info.multipv_index] =
           -material_eval(temp_pos);
     }
 
-    Move best_move = thread_info.pv[indx];
+    Move best_move = pv[indx];
 
     // Verify that the pv move is possible and legal by generating moves
 
@@ -1014,6 +1125,93 @@ void print_pv(Position &position, ThreadInfo &thread_info) {
   printf("\n");
 }
 
+// Which iterations helper thread i skips with SMPSkipDepths: runs of
+// SkipSize[i] depths, shifted by SkipPhase[i], taken from Stockfish 9.
+constexpr std::array<int, 20> SkipSize = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+constexpr std::array<int, 20> SkipPhase = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3,
+                                           4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+std::string uci_score(int score) {
+  if (abs(score) < MateScore) {
+    return "cp " + std::to_string(score * 100 / NormalizationFactor);
+  } else if (score > MateScore) {
+    return "mate " + std::to_string((-Mate - score + 1) / 2);
+  } else {
+    return "mate " + std::to_string((Mate - score) / 2);
+  }
+}
+
+ThreadInfo &select_best_thread(ThreadInfo &main_thread) {
+  // Picks the thread whose move gets the most votes, where every thread
+  // votes for the move of its last completed iteration with a weight that
+  // grows with that iteration's depth and score. A proven mate overrides
+  // the vote. Threads that didn't complete an iteration don't vote.
+
+  std::vector<ThreadInfo *> voters = {&main_thread};
+  for (ThreadInfo &td : thread_data.thread_infos) {
+    voters.push_back(&td);
+  }
+  std::erase_if(voters, [](const ThreadInfo *td) {
+    return !td->completed_depth || td->completed_pv[0] == MoveNone;
+  });
+  if (voters.empty()) {
+    return main_thread;
+  }
+
+  int min_score = voters[0]->completed_score;
+  for (const ThreadInfo *td : voters) {
+    min_score = std::min(min_score, td->completed_score);
+  }
+
+  auto votes = [&](Move move) {
+    int64_t total = 0;
+    for (const ThreadInfo *td : voters) {
+      if (td->completed_pv[0] == move) {
+        total += static_cast<int64_t>(td->completed_score - min_score + 14) *
+                 td->completed_depth;
+      }
+    }
+    return total;
+  };
+
+  ThreadInfo *best = voters[0];
+  for (ThreadInfo *td : voters) {
+    if (abs(best->completed_score) >= MateScore) {
+      // Take the shortest mate, or the longest way to be mated.
+      if (td->completed_score > best->completed_score) {
+        best = td;
+      }
+    } else if (td->completed_score >= MateScore ||
+               (td->completed_score > -MateScore &&
+                votes(td->completed_pv[0]) > votes(best->completed_pv[0]))) {
+      best = td;
+    }
+  }
+
+  return *best;
+}
+
+Move ponder_move(const Position &position, Move best_move,
+                 const ThreadInfo &thread_info) {
+  // The reply expected to best_move: the second move of the PV it came from,
+  // if it's legal.
+  if (best_move == MoveNone || thread_info.completed_pv[0] != best_move) {
+    return MoveNone;
+  }
+
+  Position moved_position = position;
+  make_move(moved_position, best_move);
+
+  std::array<Move, ListSize> moves;
+  const int nmoves = legal_movegen(moved_position, moves);
+  const Move reply = thread_info.completed_pv[1];
+  return std::find(moves.begin(), moves.begin() + nmoves, reply) !=
+                 moves.begin() + nmoves
+             ? reply
+             : MoveNone;
+}
+
 void iterative_deepen(
     Position &position, ThreadInfo &thread_info,
     std::vector<TTBucket> &TT) { // Performs an iterative deepening search.
@@ -1021,8 +1219,10 @@ void iterative_deepen(
   thread_info.original_opt = thread_info.opt_time;
   thread_info.datagen_stop = false;
   thread_info.nnue_state.reset_nnue(position, total_mat(position) < PhaseBound);
+  prepare_eval_cache(thread_info);
   calculate(position);
   thread_info.nodes = 0;
+  thread_info.unique_nodes = 0;
   thread_info.time_checks = 0;
   thread_info.phase = total_mat(position) < PhaseBound;
   thread_info.search_ply = 0; // reset all relevant thread_info
@@ -1030,24 +1230,54 @@ void iterative_deepen(
   thread_info.best_moves = {0};
   thread_info.best_scores = {ScoreNone, ScoreNone, ScoreNone, ScoreNone,
                              ScoreNone};
+  thread_info.completed_depth = 0;
   std::memset(&thread_info.KillerMoves, 0, sizeof(thread_info.KillerMoves));
 
   // Prepare root moves
   thread_info.root_moves.reserve(ListSize);
   thread_info.root_moves.clear();
+  int legal_moves;
   {
     std::array<Move, ListSize> raw_root_moves;
     int nmoves = legal_movegen(position, raw_root_moves);
+    legal_moves = nmoves;
     for (int i = 0; i < nmoves; i++) {
-      thread_info.root_moves.push_back({raw_root_moves[i], 0});
+      if (thread_info.search_moves.empty() ||
+          std::find(thread_info.search_moves.begin(),
+                    thread_info.search_moves.end(),
+                    raw_root_moves[i]) != thread_info.search_moves.end()) {
+        thread_info.root_moves.push_back({raw_root_moves[i], 0});
+      }
+    }
+
+    // If none of the searchmoves are legal, search every move.
+    if (thread_info.root_moves.empty()) {
+      for (int i = 0; i < nmoves; i++) {
+        thread_info.root_moves.push_back({raw_root_moves[i], 0});
+      }
     }
   }
 
+  // Helper diversification, see g_helper_skip_depths.
+  const bool helper = thread_info.thread_id != 0;
+  thread_info.quiet_noise = helper ? g_helper_quiet_noise : 0;
+  thread_info.rng = 0x9E3779B97F4A7C15ull * (thread_info.thread_id + 1);
+  const int start_depth =
+      helper ? 1 + (thread_info.thread_id - 1) % (g_helper_stagger + 1) : 1;
+
   Move prev_best = MoveNone;
+  int prev_score = ScoreNone;
   int alpha = ScoreNone, beta = -ScoreNone;
   int bm_stability = 0;
 
-  for (int depth = 1; depth <= thread_info.max_iter_depth; depth++) {
+  for (int depth = start_depth; depth <= thread_info.max_iter_depth; depth++) {
+
+    if (helper && g_helper_skip_depths && depth > start_depth) {
+      const int i = (thread_info.thread_id - 1) % SkipSize.size();
+      if ((depth + thread_info.game_ply + SkipPhase[i]) / SkipSize[i] % 2) {
+        continue;
+      }
+    }
 
     int real_multi_pv =
         std::min<int>(thread_info.multipv, thread_info.root_moves.size());
@@ -1057,6 +1287,15 @@ void iterative_deepen(
 
       int temp_depth = depth;
 
+      // Aspiration window around this line's score from the last iteration.
+      const int previous_score =
+          thread_info.root_moves[thread_info.multipv_index].previous_score;
+      if (depth > 7 && previous_score != ScoreNone) {
+        alpha = previous_score - 20, beta = previous_score + 20;
+      } else {
+        alpha = ScoreNone, beta = -ScoreNone;
+      }
+
       int score, delta = AspStartWindow;
 
       score =
@@ -1091,9 +1330,13 @@ void iterative_deepen(
                             ? static_cast<int64_t>(nodes) * 1000 / search_time
                             : 123456789;
 
-          Move move = score <= alpha
-                          ? prev_best
-                          : thread_info.best_moves[thread_info.multipv_index];
+          // On a fail low, the line's move from the last iteration, which
+          // the root move table still holds in this line's slot.
+          Move move =
+              score > alpha ? thread_info.best_moves[thread_info.multipv_index]
+              : thread_info.multipv_index
+                  ? thread_info.root_moves[thread_info.multipv_index].move
+                  : prev_best;
 
           printf("info multipv %i depth %i seldepth %i score cp %i %s nodes "
                  "%" PRIu64 " nps %" PRIi64 " time %" PRIi64 " pv %s\n",
@@ -1120,19 +1363,39 @@ void iterative_deepen(
         break;
       }
 
-      std::string eval_string;
-
-      if (abs(score) < MateScore) {
-        eval_string = "cp " + std::to_string(score * 100 / NormalizationFactor);
-      } else if (score > MateScore) {
-        eval_string = "mate " + std::to_string((-Mate - score + 1) / 2);
-      } else {
-        eval_string = "mate " + std::to_string((Mate - score) / 2);
+      // Rank the moves left after this line, then make sure the line's own
+      // move takes this slot even if a stale bound from a failed aspiration
+      // search sorted above it.
+      {
+        auto first = thread_info.root_moves.begin() + thread_info.multipv_index;
+        find_root_move(thread_info, thread_info.pv[0])->score = score;
+        std::stable_sort(first, thread_info.root_moves.end(),
+                         [](const RootMoveInfo &a, const RootMoveInfo &b) {
+                           return a.score > b.score;
+                         });
+        auto best = std::find_if(first, thread_info.root_moves.end(),
+                                 [&](const RootMoveInfo &root_move) {
+                                   return root_move.move == thread_info.pv[0];
+                                 });
+        std::rotate(first, best, best + 1);
       }
 
+      std::string eval_string = uci_score(score);
+
       thread_info.best_moves[thread_info.multipv_index] = thread_info.pv[0];
 
+      if (thread_info.multipv_index == 0) {
+        thread_info.completed_depth = depth;
+        thread_info.completed_score = score;
+        std::copy_n(thread_info.pv.begin(), MaxSearchDepth,
+                    thread_info.completed_pv.begin());
+      }
+
       if (thread_info.thread_id == 0) {
+        check_ponderhit(thread_info);
+        if (depth == start_depth) {
+          arm_search_timer(thread_info);
+        }
 
         uint64_t nodes = thread_info.nodes;
 
@@ -1163,8 +1426,14 @@ void iterative_deepen(
           thread_info.best_scores[0] = score * 100 / NormalizationFactor;
         }
 
+        // With a single legal move (not just a single searchmove) there's
+        // nothing to think about, so on the clock the first iteration is
+        // enough.
+        const bool forced = legal_moves == 1 &&
+                            thread_info.clock_time >= 0 && !thread_info.ponder;
+
         if (search_time > thread_info.opt_time ||
-            nodes > thread_info.opt_nodes_searched) {
+            nodes > thread_info.opt_nodes_searched || forced) {
 
           if (thread_info.doing_datagen) {
             thread_info.datagen_stop = true;
@@ -1183,15 +1452,16 @@ void iterative_deepen(
           adjust_soft_limit(
               thread_info,
               find_root_move(thread_info, thread_info.best_moves[0])->nodes,
-              bm_stability);
+              bm_stability,
+              prev_score == ScoreNone ? 0 : prev_score - score);
         }
 
         if (depth == 6 && thread_info.best_scores[0] < -100) {
           thread_info.phase = PhaseTypes::Endgame;
-          thread_info.nnue_state.reset_nnue(position, thread_info.phase);
+          thread_info.nnue_state.switch_root_phase(position, thread_info.phase);
         } else if (depth == 6 && thread_info.best_scores[0] > 300) {
           thread_info.phase = PhaseTypes::Sacrifice;
-          thread_info.nnue_state.reset_nnue(position, thread_info.phase);
+          thread_info.nnue_state.switch_root_phase(position, thread_info.phase);
         }
       }
 
@@ -1200,29 +1470,86 @@ void iterative_deepen(
       }
 
       prev_best = thread_info.best_moves[0];
-
-      if (depth > 6 && thread_info.multipv_index == 0) {
-        alpha = score - 20, beta = score + 20;
-      } else {
-        alpha = ScoreNone, beta = -ScoreNone;
+      if (thread_info.multipv_index == 0) {
+        prev_score = score;
       }
     }
+
+    for (RootMoveInfo &root_move : thread_info.root_moves) {
+      root_move.previous_score = root_move.score;
+    }
   }
 
 finish:
   // wait for all threads to finish searching
-  // printf("%i\n", thread_info.thread_id);
   if (thread_info.thread_id == 0 && !thread_info.doing_datagen) {
     thread_data.stop = true;
   }
-  search_end_barrier.arrive_and_wait();
+  if (thread_info.thread_id == 0) {
+    thread_pool.wait_for_idle();
+
+    // bestmove can't be sent while pondering, even if the search is over.
+    while (thread_data.pondering) {
+      thread_data.pondering.wait(true);
+    }
+
+    // A node limit with a clock means a weakened level, which shouldn't move
+    // instantly: wait out the soft limit here, without searching.
+    if (!thread_info.doing_datagen && thread_info.max_time < INT32_MAX / 3 &&
+        thread_info.nodes >= thread_info.max_nodes_searched) {
+      search_timer.hold_until(thread_info.start_time +
+                              std::chrono::milliseconds(thread_info.opt_time));
+    }
+  }
   if (thread_info.thread_id == 0 && !thread_info.doing_datagen &&
       !thread_info.is_human) {
-    printf("bestmove %s\n",
-           internal_to_uci(position, thread_info.best_moves[0]).c_str());
+    if (thread_data.debug) {
+      uint64_t probes = thread_info.eval_cache.probes;
+      uint64_t hits = thread_info.eval_cache.hits;
+      for (const ThreadInfo &helper : thread_data.thread_infos) {
+        probes += helper.eval_cache.probes, hits += helper.eval_cache.hits;
+      }
+      printf("info string eval cache %" PRIu64 " hits / %" PRIu64
+             " probes (%.1f%%)\n",
+             hits, probes, probes ? hits * 100.0 / probes : 0.0);
+    }
+
+    // With helpers, the move comes from the thread that wins the vote. Its
+    // PV is printed again so that it matches the bestmove.
+    const ThreadInfo *pv_thread = &thread_info;
+    if (!thread_data.thread_infos.empty() && thread_info.multipv == 1) {
+      ThreadInfo &best_thread = select_best_thread(thread_info);
+      pv_thread = &best_thread;
+
+      if (&best_thread != &thread_info) {
+        printf("info depth %i score %s pv ", best_thread.completed_depth,
+               uci_score(best_thread.completed_score).c_str());
+        print_pv(position, best_thread, best_thread.completed_pv.data());
+        thread_info.best_moves[0] = best_thread.completed_pv[0];
+        thread_info.best_scores[0] = best_thread.completed_score;
+      }
+      printf("info string bestmove from thread %i (depth %i)\n",
+             best_thread.thread_id, best_thread.completed_depth);
+    }
+
+    log_time(thread_info, time_elapsed(thread_info.start_time));
+
+    const Move best_move = thread_info.best_moves[0];
+    const Move ponder = ponder_move(position, best_move, *pv_thread);
+    printf("bestmove %s", internal_to_uci(position, best_move).c_str());
+    if (ponder != MoveNone) {
+      Position moved_position = position;
+      make_move(moved_position, best_move);
+      printf(" ponder %s", internal_to_uci(moved_position, ponder).c_str());
+    }
+    printf("\n");
   }
 }
 
+void helper_search(ThreadInfo &thread_info) {
+  iterative_deepen(thread_info.position, thread_info, TT);
+}
+
 void search_position(Position &position, ThreadInfo &thread_info,
                      std::vector<TTBucket> &TT) {
 
@@ -1230,38 +1557,24 @@ void search_position(Position &position, ThreadInfo &thread_info,
   thread_info.thread_id = 0;
   thread_info.nodes = 0;
 
-  int num_threads = thread_data.num_threads;
-
   // Wait for threads to be ready
-  reset_barrier.arrive_and_wait();
+  thread_pool.wait_for_idle();
 
-  for (int i = 0; i < thread_data.thread_infos.size(); i++) {
-    thread_data.thread_infos[i] = thread_info;
+  for (size_t i = 0; i < thread_data.thread_infos.size(); i++) {
+    set_search_root(thread_data.thread_infos[i], thread_info);
     thread_data.thread_infos[i].thread_id = i + 1;
   }
 
   // Tell threads to start
-  idle_barrier.arrive_and_wait();
-
+  search_timer.disarm();
   thread_data.stop = false;
+  thread_pool.start(helper_search);
+
   iterative_deepen(position, thread_info, TT);
+  search_timer.disarm();
   if (!thread_info.doing_datagen) {
     thread_data.stop = true;
   }
 
   thread_info.searches = (thread_info.searches + 1) % MaxAge;
 }
-
-void loop(int i) {
-  while (true) {
-    reset_barrier.arrive_and_wait();
-    idle_barrier.arrive_and_wait();
-    if (thread_data.terminate) {
-      return;
-    }
-    thread_data.thread_infos[i].searching = true;
-    iterative_deepen(thread_data.thread_infos[i].position,
-                     thread_data.thread_infos[i], TT);
-    thread_data.thread_infos[i].searching = false;
-  }
-}
@@ -4,96 +4,189 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
 #include <immintrin.h>
+#endif
+
+// Everything built on these wrappers lives in a namespace named after the
+// instruction set level it was compiled for. A dispatch build compiles the
+// kernels once per level, and the namespaces keep the copies apart.
+#ifndef SIMD_ARCH
+#define SIMD_ARCH native
+#endif
+
+namespace SIMD_ARCH {
+
+#if defined(__AVX512BW__)
 constexpr size_t REGISTER_SIZE = 32;
+constexpr size_t REGISTER_COUNT = 32;
+#if defined(__AVX512VNNI__)
+constexpr const char *SIMD_NAME = "avx512vnni";
+#else
+constexpr const char *SIMD_NAME = "avx512bw";
+#endif
+using vec_int16 = __m512i;
 #elif defined(__AVX2__)
-#include <immintrin.h>
 constexpr size_t REGISTER_SIZE = 16;
+constexpr size_t REGISTER_COUNT = 16;
+constexpr const char *SIMD_NAME = "avx2";
+using vec_int16 = __m256i;
+#elif defined(__SSE2__)
+constexpr size_t REGISTER_SIZE = 8;
+#if defined(__x86_64__) || defined(_M_X64)
+constexpr size_t REGISTER_COUNT = 16;
+#else
+constexpr size_t REGISTER_COUNT = 8;
+#endif
+constexpr const char *SIMD_NAME = "sse2";
+using vec_int16 = __m128i;
 
 #else
 constexpr size_t REGISTER_SIZE = 0;
+constexpr size_t REGISTER_COUNT = 0;
+constexpr const char *SIMD_NAME = "scalar";
+using vec_int16 = int16_t;
 
 #endif
 
 auto inline int16_load(auto data) {
 
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_load_si512(reinterpret_cast<const __m512i *>(data));
 #elif defined(__AVX2__)
   return _mm256_load_si256(reinterpret_cast<const __m256i *>(data));
+#elif defined(__SSE2__)
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(data));
 #else
   return 0;
 #endif
 }
 
+auto inline int16_store(auto data, auto vec) {
+#if defined(__AVX512BW__)
+  _mm512_store_si512(reinterpret_cast<__m512i *>(data), vec);
+#elif defined(__AVX2__)
+  _mm256_store_si256(reinterpret_cast<__m256i *>(data), vec);
+#elif defined(__SSE2__)
+  _mm_store_si128(reinterpret_cast<__m128i *>(data), vec);
+#endif
+}
+
 auto inline get_int16_vec(auto data) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_set1_epi16(data);
 #elif defined(__AVX2__)
   return _mm256_set1_epi16(data);
+#elif defined(__SSE2__)
+  return _mm_set1_epi16(data);
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int16_clamp(auto vec, auto min_vec, auto max_vec) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_min_epi16(_mm512_max_epi16(vec, min_vec), max_vec);
-  return vec;
 #elif defined(__AVX2__)
   return _mm256_min_epi16(_mm256_max_epi16(vec, min_vec), max_vec);
+#elif defined(__SSE2__)
+  return _mm_min_epi16(_mm_max_epi16(vec, min_vec), max_vec);
+#else
+  return 0;
+#endif
+}
+
+auto inline vec_int16_add(auto vec1, auto vec2) {
+#if defined(__AVX512BW__)
+  return _mm512_add_epi16(vec1, vec2);
+#elif defined(__AVX2__)
+  return _mm256_add_epi16(vec1, vec2);
+#elif defined(__SSE2__)
+  return _mm_add_epi16(vec1, vec2);
+#else
+  return 0;
+#endif
+}
+
+auto inline vec_int16_sub(auto vec1, auto vec2) {
+#if defined(__AVX512BW__)
+  return _mm512_sub_epi16(vec1, vec2);
+#elif defined(__AVX2__)
+  return _mm256_sub_epi16(vec1, vec2);
+#elif defined(__SSE2__)
+  return _mm_sub_epi16(vec1, vec2);
+#else
+  return 0;
+#endif
+}
+
+auto inline vec_int16_shift_right(auto vec, int shift) {
+#if defined(__AVX512BW__)
+  return _mm512_srli_epi16(vec, shift);
+#elif defined(__AVX2__)
+  return _mm256_srli_epi16(vec, shift);
+#elif defined(__SSE2__)
+  return _mm_srli_epi16(vec, shift);
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int16_multiply(auto vec1, auto vec2) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_mullo_epi16(vec1, vec2);
 #elif defined(__AVX2__)
   return _mm256_mullo_epi16(vec1, vec2);
+#elif defined(__SSE2__)
+  return _mm_mullo_epi16(vec1, vec2);
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int32_zero() {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_setzero_si512();
 #elif defined(__AVX2__)
   return _mm256_setzero_si256();
+#elif defined(__SSE2__)
+  return _mm_setzero_si128();
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int32_add(auto vec1, auto vec2) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_add_epi32(vec1, vec2);
 #elif defined(__AVX2__)
   return _mm256_add_epi32(vec1, vec2);
+#elif defined(__SSE2__)
+  return _mm_add_epi32(vec1, vec2);
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int16_madd_int32(auto vec1, auto vec2) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   return _mm512_madd_epi16(vec1, vec2);
 #elif defined(__AVX2__)
   return _mm256_madd_epi16(vec1, vec2);
+#elif defined(__SSE2__)
+  return _mm_madd_epi16(vec1, vec2);
 #else
   return 0;
 #endif
 }
 
 auto inline vec_int32_hadd(auto vec) {
-#if defined(__AVX512F__)
+#if defined(__AVX512BW__)
   auto low = _mm512_castsi512_si256(vec);
-  auto high = _mm512_extracti32x8_epi32(vec, 1);
+  auto high = _mm512_extracti64x4_epi64(vec, 1);
   auto sum8 = _mm256_add_epi32(low, high);
   auto sum4 = _mm256_hadd_epi32(sum8, sum8);
   auto sum2 = _mm256_hadd_epi32(sum4, sum4);
@@ -113,7 +206,14 @@ auto inline vec_int32_hadd(auto vec) {
   auto rel = _mm_extract_epi32(result, 0);
 
   return rel;
+#elif defined(__SSE2__)
+  auto sum_into_2 = _mm_add_epi32(vec, _mm_unpackhi_epi64(vec, vec));
+  auto sum_into_1 =
+      _mm_add_epi32(sum_into_2, _mm_shuffle_epi32(sum_into_2, 0b01));
+  return _mm_cvtsi128_si32(sum_into_1);
 #else
   return 0;
 #endif
 }
+
+} // namespace SIMD_ARCH
@@ -0,0 +1,87 @@
+#pragma once
+#include "search.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lazy SMP scaling over the bench positions: every position is searched from
+// a new game to a fixed depth at 1, 2, 4, 8, 16 and max_threads threads,
+// timing how long the main thread takes to complete the depth and counting
+// the nodes that searched a position no thread had searched before in that
+// search. Run it with and without the SMP* options to see what helper
+// diversification does.
+
+struct SMPBenchResult {
+  int threads;
+  int64_t us = 0;
+  uint64_t nodes = 0;
+  uint64_t unique_nodes = 0;
+};
+
+void smpbench(Position &position, ThreadInfo &thread_info,
+              const std::vector<std::string> &fens, int depth,
+              int max_threads) {
+  const size_t helpers = thread_pool.size();
+  max_threads = std::max(max_threads, 1);
+
+  std::vector<int> thread_counts;
+  for (int threads : {1, 2, 4, 8, 16}) {
+    if (threads < max_threads) {
+      thread_counts.push_back(threads);
+    }
+  }
+  thread_counts.push_back(max_threads);
+
+  reset_search_limits(thread_info);
+  thread_info.max_iter_depth = depth;
+
+  g_unique_nodes = std::make_unique<std::atomic<uint64_t>[]>(UniqueNodeBits / 64);
+
+  std::vector<SMPBenchResult> results;
+
+  for (int threads : thread_counts) {
+    thread_pool.resize(threads - 1);
+    SMPBenchResult &result = results.emplace_back();
+    result.threads = threads;
+
+    for (const std::string &fen : fens) {
+      new_game(thread_info, TT);
+      set_board(position, thread_info, fen);
+      for (uint64_t i = 0; i < UniqueNodeBits / 64; i++) {
+        g_unique_nodes[i].store(0, std::memory_order_relaxed);
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      thread_info.start_time = start;
+      search_position(position, thread_info, TT);
+      result.us += std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+      result.nodes += thread_info.nodes;
+      result.unique_nodes += thread_info.unique_nodes;
+      for (const ThreadInfo &helper : thread_data.thread_infos) {
+        result.nodes += helper.nodes;
+        result.unique_nodes += helper.unique_nodes;
+      }
+    }
+  }
+
+  g_unique_nodes.reset();
+  thread_pool.resize(helpers);
+  new_game(thread_info, TT);
+
+  printf("\nSMP scaling, %zu positions to depth %i (skip depths %s, stagger "
+         "%i, quiet noise %i, ABDADA %s)\n",
+         fens.size(), depth, g_helper_skip_depths ? "on" : "off",
+         g_helper_stagger, g_helper_quiet_noise, g_abdada ? "on" : "off");
+  printf("%8s %12s %8s %12s %12s %8s\n", "threads", "time (ms)", "speedup",
+         "nodes", "nps", "unique");
+  for (const SMPBenchResult &r : results) {
+    printf("%8i %12.1f %8.2f %12" PRIu64 " %12" PRIu64 " %7.1f%%\n", r.threads,
+           r.us / 1000.0, double(results[0].us) / std::max<int64_t>(r.us, 1),
+           r.nodes, r.nodes * 1000000 / std::max<int64_t>(r.us, 1),
+           r.nodes ? r.unique_nodes * 100.0 / r.nodes : 0.0);
+  }
+}
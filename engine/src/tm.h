@@ -1,12 +1,72 @@
 #pragma once
 #include "defs.h"
 #include "utils.h"
+#include <stdio.h>
+#include <string>
 
-void adjust_soft_limit(ThreadInfo &thread_info, uint64_t best_move_nodes, int bm_stability) {
+int g_move_overhead = 50;  // ms kept back from the clock for lag
+std::string g_time_log;    // file to append a line to per timed move, "" = off
+
+// Limits for a search on the clock. With movestogo, the time left is spread
+// over the moves to the next time control (sudden death is treated like 18
+// moves to go), and the hard limit is capped so that one move can't eat the
+// time of the next few.
+void set_time_limits(SearchRoot &root, int time, int increment, int movestogo) {
+  root.clock_time = time, root.clock_increment = increment;
+  root.movestogo = movestogo;
+
+  time = std::max(2, time - g_move_overhead);
+  const int divisor = movestogo > 0 ? std::min(movestogo, 18) + 2 : 20;
+
+  root.max_time = time / 2;
+  root.opt_time = (time / divisor + increment * 8 / 10) * 6 / 10;
+
+  if (movestogo > 0) {
+    root.max_time = std::min<int64_t>(root.max_time,
+                                      int64_t(time) * 3 / (movestogo + 2));
+  }
+}
+
+void adjust_soft_limit(ThreadInfo &thread_info, uint64_t best_move_nodes, int bm_stability,
+                       int score_drop) {
   double fract = (double)best_move_nodes / thread_info.nodes;
   double factor = (NodeTmFactor1 / 100.0f - fract) * NodeTmFactor2 / 100.0f;
   double bm_factor = BmFactor1 / 100.0f - (bm_stability * 0.06);
 
-  thread_info.opt_time = std::min<uint32_t>(thread_info.original_opt * factor * bm_factor,
-                                            thread_info.max_time);
-}
\ No newline at end of file
+  // A falling score means the position is harder than it looked: give it up
+  // to ScoreTmFactor% more time, reached at a drop of 100.
+  double score_factor =
+      1.0 + std::clamp(score_drop, 0, 100) * ScoreTmFactor / 10000.0;
+
+  thread_info.opt_time = std::min<uint32_t>(
+      thread_info.original_opt * factor * bm_factor * score_factor,
+      thread_info.max_time);
+}
+
+// One CSV line per move played on the clock: what we had, what we allotted
+// and what we used, all in ms. used counts from the ponderhit when pondering,
+// and ply from the position the position command started from.
+void log_time(const ThreadInfo &thread_info, int64_t used) {
+  if (g_time_log.empty() || thread_info.clock_time < 0) {
+    return;
+  }
+  FILE *file = fopen(g_time_log.c_str(), "a");
+  if (!file) {
+    return;
+  }
+  if (ftell(file) == 0) {
+    fprintf(file, "ply,time,inc,movestogo,overhead,opt,max,final_opt,used,"
+                  "depth,nodes\n");
+  }
+
+  uint64_t nodes = thread_info.nodes;
+  for (const ThreadInfo &helper : thread_data.thread_infos) {
+    nodes += helper.nodes;
+  }
+  fprintf(file, "%i,%i,%i,%i,%i,%u,%u,%u,%" PRIi64 ",%i,%" PRIu64 "\n",
+          thread_info.game_ply - 6, thread_info.clock_time,
+          thread_info.clock_increment, thread_info.movestogo, g_move_overhead,
+          thread_info.original_opt, thread_info.max_time, thread_info.opt_time,
+          used, thread_info.completed_depth, nodes);
+  fclose(file);
+}
@@ -1,6 +1,9 @@
 #pragma once
 #include "human.h"
+#include "nnuebench.h"
 #include "search.h"
+#include "smpbench.h"
+#include <fstream>
 #include <iostream>
 #include <memory>
 
@@ -22,6 +25,18 @@ void run_thread(Position &position, ThreadInfo &thread_info, std::thread &s) {
   }
 }
 
+void stop_search(std::thread &s) {
+  // Stops the running search, pondering or not, and waits for its bestmove.
+  thread_data.stop = true;
+  thread_data.pondering = false;
+  thread_data.pondering.notify_all();
+  search_timer.release();
+
+  if (s.joinable()) {
+    s.join();
+  }
+}
+
 uint64_t perft(int depth, Position &position, bool first,
                ThreadInfo &thread_info)
 // Performs a perft search to the desired depth,
@@ -67,78 +82,182 @@ uint64_t perft(int depth, Position &position, bool first,
   return total_nodes;
 }
 
+const std::vector<std::string> bench_fens = {
+    "2r2k2/8/4P1R1/1p6/8/P4K1N/7b/2B5 b - - 0 55\0",
+    "2r4r/1p4k1/1Pnp4/3Qb1pq/8/4BpPp/5P2/2RR1BK1 w - - 0 42\0",
+    "6k1/5pp1/8/2bKP2P/2P5/p4PNb/B7/8 b - - 1 44\0",
+    "6r1/5k2/p1b1r2p/1pB1p1p1/1Pp3PP/2P1R1K1/2P2P2/3R4 w - - 1 36\0",
+    "4rrk1/2p1b1p1/p1p3q1/4p3/2P2n1p/1P1NR2P/PB3PP1/3R1QK1 b - - 2 24\0",
+    "3br1k1/p1pn3p/1p3n2/5pNq/2P1p3/1PN3PP/P2Q1PB1/4R1K1 w - - 0 23\0",
+    "r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14\0",
+    "r3qbrk/6p1/2b2pPp/p3pP1Q/PpPpP2P/3P1B2/2PB3K/R5R1 w - - 16 42\0",
+    "6k1/1R3p2/6p1/2Bp3p/3P2q1/P7/1P2rQ1K/5R2 b - - 4 44\0",
+    "8/8/1p2k1p1/3p3p/1p1P1P1P/1P2PK2/8/8 w - - 3 54\0",
+    "7r/2p3k1/1p1p1qp1/1P1Bp3/p1P2r1P/P7/4R3/Q4RK1 w - - 0 36\0",
+    "r1bq1rk1/pp2b1pp/n1pp1n2/3P1p2/2P1p3/2N1P2N/PP2BPPP/R1BQ1RK1 b - - 2 "
+    "10\0",
+    "3r3k/2r4p/1p1b3q/p4P2/P2Pp3/1B2P3/3BQ1RP/6K1 w - - 3 87\0",
+    "4q1bk/6b1/7p/p1p4p/PNPpP2P/KN4P1/3Q4/4R3 b - - 0 37\0",
+    "2q3r1/1r2pk2/pp3pp1/2pP3p/P1Pb1BbP/1P4Q1/R3NPP1/4R1K1 w - - 2 34\0",
+    "1r2r2k/1b4q1/pp5p/2pPp1p1/P3Pn2/1P1B1Q1P/2R3P1/4BR1K b - - 1 37\0",
+    "r3kbbr/pp1n1p1P/3ppnp1/q5N1/1P1pP3/P1N1B3/2P1QP2/R3KB1R b KQkq b3 0 "
+    "17\0",
+    "8/6pk/2b1Rp2/3r4/1R1B2PP/P5K1/8/2r5 b - - 16 42\0",
+    "1r4k1/4ppb1/2n1b1qp/pB4p1/1n1BP1P1/7P/2PNQPK1/3RN3 w - - 8 29\0",
+    "8/p2B4/PkP5/4p1pK/4Pb1p/5P2/8/8 w - - 29 68\0",
+    "3r4/ppq1ppkp/4bnp1/2pN4/2P1P3/1P4P1/PQ3PBP/R4K2 b - - 2 20\0",
+    "5rr1/4n2k/4q2P/P1P2n2/3B1p2/4pP2/2N1P3/1RR1K2Q w - - 1 49\0",
+    "1r5k/2pq2p1/3p3p/p1pP4/4QP2/PP1R3P/6PK/8 w - - 1 51\0",
+    "q5k1/5ppp/1r3bn1/1B6/P1N2P2/BQ2P1P1/5K1P/8 b - - 2 34\0",
+    "r1b2k1r/5n2/p4q2/1ppn1Pp1/3pp1p1/NP2P3/P1PPBK2/1RQN2R1 w - - 0 22\0",
+    "r1bqk2r/pppp1ppp/5n2/4b3/4P3/P1N5/1PP2PPP/R1BQKB1R w KQkq - 0 5\0",
+    "r1bqr1k1/pp1p1ppp/2p5/8/3N1Q2/P2BB3/1PP2PPP/R3K2n b Q - 1 12\0",
+    "r1bq2k1/p4r1p/1pp2pp1/3p4/1P1B3Q/P2B1N2/2P3PP/4R1K1 b - - 2 19\0",
+    "r4qk1/6r1/1p4p1/2ppBbN1/1p5Q/P7/2P3PP/5RK1 w - - 2 25\0",
+    "r7/6k1/1p6/2pp1p2/7Q/8/p1P2K1P/8 w - - 0 32\0",
+    "r3k2r/ppp1pp1p/2nqb1pn/3p4/4P3/2PP4/PP1NBPPP/R2QK1NR w KQkq - 1 5\0",
+    "3r1rk1/1pp1pn1p/p1n1q1p1/3p4/Q3P3/2P5/PP1NBPPP/4RRK1 w - - 0 12\0",
+    "5rk1/1pp1pn1p/p3Brp1/8/1n6/5N2/PP3PPP/2R2RK1 w - - 2 20\0",
+    "8/1p2pk1p/p1p1r1p1/3n4/8/5R2/PP3PPP/4R1K1 b - - 3 27\0",
+    "8/4pk2/1p1r2p1/p1p4p/Pn5P/3R4/1P3PP1/4RK2 w - - 1 33\0",
+    "8/5k2/1pnrp1p1/p1p4p/P6P/4R1PK/1P3P2/4R3 b - - 1 38\0",
+    "8/8/1p1kp1p1/p1pr1n1p/P6P/1R4P1/1P3PK1/1R6 b - - 15 45\0",
+    "8/8/1p1k2p1/p1prp2p/P2n3P/6P1/1P1R1PK1/4R3 b - - 5 49\0",
+    "8/8/1p4p1/p1p2k1p/P2npP1P/4K1P1/1P6/3R4 w - - 6 54\0",
+    "8/8/1p4p1/p1p2k1p/P2n1P1P/4K1P1/1P6/6R1 b - - 6 59\0",
+    "8/5k2/1p4p1/p1pK3p/P2n1P1P/6P1/1P6/4R3 b - - 14 63\0",
+    "8/1R6/1p1K1kp1/p6p/P1p2P1P/6P1/1Pn5/8 w - - 0 67\0",
+    "1rb1rn1k/p3q1bp/2p3p1/2p1p3/2P1P2N/PP1RQNP1/1B3P2/4R1K1 b - - 4 23\0",
+    "4rrk1/pp1n1pp1/q5p1/P1pP4/2n3P1/7P/1P3PB1/R1BQ1RK1 w - - 3 22\0",
+    "r2qr1k1/pb1nbppp/1pn1p3/2ppP3/3P4/2PB1NN1/PP3PPP/R1BQR1K1 w - - 4 "
+    "12\0",
+    "2rqr1k1/1p3p1p/p2p2p1/P1nPb3/2B1P3/5P2/1PQ2NPP/R1R4K w - - 3 25\0",
+    "r1b2rk1/p1q1ppbp/6p1/2Q5/8/4BP2/PPP3PP/2KR1B1R b - - 2 14\0",
+    "rnbqkb1r/pppppppp/5n2/8/2PP4/8/PP2PPPP/RNBQKBNR b KQkq c3 0 2\0",
+    "2rr2k1/1p4bp/p1q1p1p1/4Pp1n/2PB4/1PN3P1/P3Q2P/2RR2K1 w - f6 0 20\0",
+    "2r2b2/5p2/5k2/p1r1pP2/P2pB3/1P3P2/K1P3R1/7R w - - 23 93\0"};
+
 void bench(Position &position, ThreadInfo &thread_info) {
-  std::vector<std::string> fens = {
-      "2r2k2/8/4P1R1/1p6/8/P4K1N/7b/2B5 b - - 0 55\0",
-      "2r4r/1p4k1/1Pnp4/3Qb1pq/8/4BpPp/5P2/2RR1BK1 w - - 0 42\0",
-      "6k1/5pp1/8/2bKP2P/2P5/p4PNb/B7/8 b - - 1 44\0",
-      "6r1/5k2/p1b1r2p/1pB1p1p1/1Pp3PP/2P1R1K1/2P2P2/3R4 w - - 1 36\0",
-      "4rrk1/2p1b1p1/p1p3q1/4p3/2P2n1p/1P1NR2P/PB3PP1/3R1QK1 b - - 2 24\0",
-      "3br1k1/p1pn3p/1p3n2/5pNq/2P1p3/1PN3PP/P2Q1PB1/4R1K1 w - - 0 23\0",
-      "r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14\0",
-      "r3qbrk/6p1/2b2pPp/p3pP1Q/PpPpP2P/3P1B2/2PB3K/R5R1 w - - 16 42\0",
-      "6k1/1R3p2/6p1/2Bp3p/3P2q1/P7/1P2rQ1K/5R2 b - - 4 44\0",
-      "8/8/1p2k1p1/3p3p/1p1P1P1P/1P2PK2/8/8 w - - 3 54\0",
-      "7r/2p3k1/1p1p1qp1/1P1Bp3/p1P2r1P/P7/4R3/Q4RK1 w - - 0 36\0",
-      "r1bq1rk1/pp2b1pp/n1pp1n2/3P1p2/2P1p3/2N1P2N/PP2BPPP/R1BQ1RK1 b - - 2 "
-      "10\0",
-      "3r3k/2r4p/1p1b3q/p4P2/P2Pp3/1B2P3/3BQ1RP/6K1 w - - 3 87\0",
-      "4q1bk/6b1/7p/p1p4p/PNPpP2P/KN4P1/3Q4/4R3 b - - 0 37\0",
-      "2q3r1/1r2pk2/pp3pp1/2pP3p/P1Pb1BbP/1P4Q1/R3NPP1/4R1K1 w - - 2 34\0",
-      "1r2r2k/1b4q1/pp5p/2pPp1p1/P3Pn2/1P1B1Q1P/2R3P1/4BR1K b - - 1 37\0",
-      "r3kbbr/pp1n1p1P/3ppnp1/q5N1/1P1pP3/P1N1B3/2P1QP2/R3KB1R b KQkq b3 0 "
-      "17\0",
-      "8/6pk/2b1Rp2/3r4/1R1B2PP/P5K1/8/2r5 b - - 16 42\0",
-      "1r4k1/4ppb1/2n1b1qp/pB4p1/1n1BP1P1/7P/2PNQPK1/3RN3 w - - 8 29\0",
-      "8/p2B4/PkP5/4p1pK/4Pb1p/5P2/8/8 w - - 29 68\0",
-      "3r4/ppq1ppkp/4bnp1/2pN4/2P1P3/1P4P1/PQ3PBP/R4K2 b - - 2 20\0",
-      "5rr1/4n2k/4q2P/P1P2n2/3B1p2/4pP2/2N1P3/1RR1K2Q w - - 1 49\0",
-      "1r5k/2pq2p1/3p3p/p1pP4/4QP2/PP1R3P/6PK/8 w - - 1 51\0",
-      "q5k1/5ppp/1r3bn1/1B6/P1N2P2/BQ2P1P1/5K1P/8 b - - 2 34\0",
-      "r1b2k1r/5n2/p4q2/1ppn1Pp1/3pp1p1/NP2P3/P1PPBK2/1RQN2R1 w - - 0 22\0",
-      "r1bqk2r/pppp1ppp/5n2/4b3/4P3/P1N5/1PP2PPP/R1BQKB1R w KQkq - 0 5\0",
-      "r1bqr1k1/pp1p1ppp/2p5/8/3N1Q2/P2BB3/1PP2PPP/R3K2n b Q - 1 12\0",
-      "r1bq2k1/p4r1p/1pp2pp1/3p4/1P1B3Q/P2B1N2/2P3PP/4R1K1 b - - 2 19\0",
-      "r4qk1/6r1/1p4p1/2ppBbN1/1p5Q/P7/2P3PP/5RK1 w - - 2 25\0",
-      "r7/6k1/1p6/2pp1p2/7Q/8/p1P2K1P/8 w - - 0 32\0",
-      "r3k2r/ppp1pp1p/2nqb1pn/3p4/4P3/2PP4/PP1NBPPP/R2QK1NR w KQkq - 1 5\0",
-      "3r1rk1/1pp1pn1p/p1n1q1p1/3p4/Q3P3/2P5/PP1NBPPP/4RRK1 w - - 0 12\0",
-      "5rk1/1pp1pn1p/p3Brp1/8/1n6/5N2/PP3PPP/2R2RK1 w - - 2 20\0",
-      "8/1p2pk1p/p1p1r1p1/3n4/8/5R2/PP3PPP/4R1K1 b - - 3 27\0",
-      "8/4pk2/1p1r2p1/p1p4p/Pn5P/3R4/1P3PP1/4RK2 w - - 1 33\0",
-      "8/5k2/1pnrp1p1/p1p4p/P6P/4R1PK/1P3P2/4R3 b - - 1 38\0",
-      "8/8/1p1kp1p1/p1pr1n1p/P6P/1R4P1/1P3PK1/1R6 b - - 15 45\0",
-      "8/8/1p1k2p1/p1prp2p/P2n3P/6P1/1P1R1PK1/4R3 b - - 5 49\0",
-      "8/8/1p4p1/p1p2k1p/P2npP1P/4K1P1/1P6/3R4 w - - 6 54\0",
-      "8/8/1p4p1/p1p2k1p/P2n1P1P/4K1P1/1P6/6R1 b - - 6 59\0",
-      "8/5k2/1p4p1/p1pK3p/P2n1P1P/6P1/1P6/4R3 b - - 14 63\0",
-      "8/1R6/1p1K1kp1/p6p/P1p2P1P/6P1/1Pn5/8 w - - 0 67\0",
-      "1rb1rn1k/p3q1bp/2p3p1/2p1p3/2P1P2N/PP1RQNP1/1B3P2/4R1K1 b - - 4 23\0",
-      "4rrk1/pp1n1pp1/q5p1/P1pP4/2n3P1/7P/1P3PB1/R1BQ1RK1 w - - 3 22\0",
-      "r2qr1k1/pb1nbppp/1pn1p3/2ppP3/3P4/2PB1NN1/PP3PPP/R1BQR1K1 w - - 4 "
-      "12\0",
-      "2rqr1k1/1p3p1p/p2p2p1/P1nPb3/2B1P3/5P2/1PQ2NPP/R1R4K w - - 3 25\0",
-      "r1b2rk1/p1q1ppbp/6p1/2Q5/8/4BP2/PPP3PP/2KR1B1R b - - 2 14\0",
-      "rnbqkb1r/pppppppp/5n2/8/2PP4/8/PP2PPPP/RNBQKBNR b KQkq c3 0 2\0",
-      "2rr2k1/1p4bp/p1q1p1p1/4Pp1n/2PB4/1PN3P1/P3Q2P/2RR2K1 w - f6 0 20\0",
-      "2r2b2/5p2/5k2/p1r1pP2/P2pB3/1P3P2/K1P3R1/7R w - - 23 93\0"};
-
-  thread_info.max_time = INT32_MAX / 2, thread_info.opt_time = INT32_MAX / 2;
+  reset_search_limits(thread_info);
   thread_info.max_iter_depth = 12;
   uint64_t total_nodes = 0;
+  uint64_t cache_probes = 0, cache_hits = 0;
+
+  const NNUE_State &nnue = thread_info.nnue_state;
+  uint64_t queued_updates = nnue.m_queued_updates;
+  uint64_t applied_updates = nnue.m_applied_updates;
+  uint64_t extra_updates = nnue.m_extra_updates;
+  uint64_t phase_switches = nnue.m_phase_switches;
+  uint64_t phase_refreshes = nnue.m_phase_refreshes;
+  int64_t phase_refresh_ns = nnue.m_phase_refresh_ns;
 
   auto start = std::chrono::steady_clock::now();
 
-  for (std::string fen : fens) {
+  for (std::string fen : bench_fens) {
     new_game(thread_info, TT);
     set_board(position, thread_info, fen);
     thread_info.start_time = std::chrono::steady_clock::now();
     search_position(position, thread_info, TT);
     total_nodes += thread_info.nodes;
+    cache_probes += thread_info.eval_cache.probes;
+    cache_hits += thread_info.eval_cache.hits;
+  }
+
+  const int64_t nps = total_nodes * 1000 / time_elapsed(start);
+
+  queued_updates = nnue.m_queued_updates - queued_updates;
+  applied_updates = nnue.m_applied_updates - applied_updates;
+  extra_updates = nnue.m_extra_updates - extra_updates;
+  phase_switches = nnue.m_phase_switches - phase_switches;
+  phase_refreshes = nnue.m_phase_refreshes - phase_refreshes;
+  phase_refresh_ns = nnue.m_phase_refresh_ns - phase_refresh_ns;
+
+  printf("NNUE updates: %" PRIu64 " queued %" PRIu64 " applied %" PRIu64
+         " skipped\n",
+         queued_updates, applied_updates, queued_updates - applied_updates);
+
+  // What phase switches cost in refreshes, against what keeping every phase
+  // net's accumulator costs (or would cost) in extra incremental updates.
+  const int feature_transformers = count_feature_transformers();
+  if (!g_all_phase_accumulators) {
+    extra_updates = applied_updates * (feature_transformers - 1);
+  }
+
+  printf("NNUE phase switches: %" PRIu64 ", %" PRIu64
+         " refreshed in %.2f ms\n",
+         phase_switches, phase_refreshes, phase_refresh_ns / 1e6);
+  printf("NNUE all-phase accumulators: %s, %d feature transformer(s), %" PRIu64
+         " extra updates (~%.2f ms)\n",
+         g_all_phase_accumulators ? "on" : "off", feature_transformers,
+         extra_updates, extra_updates * measure_update_ns() / 1e6);
+
+  printf("Eval cache: %" PRIu64 " hits / %" PRIu64 " probes (%.1f%%)\n",
+         cache_hits, cache_probes,
+         cache_probes ? cache_hits * 100.0 / cache_probes : 0.0);
+
+  printf("CPU level: %s\n", CpuLevelNames[g_cpu_level]);
+
+  printf("Bench: %" PRIu64 " nodes %" PRIi64 " nps\n", total_nodes, nps);
+}
+
+void evalbatch(const std::string &path, int phase) {
+  // Scores every position of an EPD (or "fen | eval | result") file with the
+  // batched evaluator and prints each line followed by its NNUE score, from
+  // the side to move's point of view.
+
+  std::ifstream in(path);
+  if (!in) {
+    printf("info string Could not open %s\n", path.c_str());
+    return;
+  }
+
+  std::vector<std::string> lines;
+  std::vector<Position> positions;
+  std::vector<int> scores;
+  std::string line, output;
+  uint64_t total = 0;
+  int64_t eval_time = 0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  auto flush = [&]() {
+    scores.resize(positions.size());
+
+    auto eval_start = std::chrono::steady_clock::now();
+    evaluate_batch(positions, phase, scores);
+    eval_time += std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - eval_start)
+                     .count();
+
+    output.clear();
+    for (size_t i = 0; i < lines.size(); i++) {
+      output += lines[i] + " | " + std::to_string(scores[i]) + "\n";
+    }
+    fwrite(output.data(), 1, output.size(), stdout);
+
+    total += positions.size();
+    lines.clear(), positions.clear();
+  };
+
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    positions.emplace_back();
+    set_board_pieces(positions.back(), line);
+    lines.push_back(line);
+
+    if (positions.size() == EVAL_BATCH_SIZE * 512) {
+      flush();
+    }
   }
+  flush();
 
-  printf("Bench: %" PRIu64 " nodes %" PRIi64 " nps\n", total_nodes,
-         (int64_t)(total_nodes * 1000 / time_elapsed(start)));
+  printf("info string evalbatch %" PRIu64 " positions in %" PRIi64
+         " ms, %" PRIu64 " evals/s (%" PRIu64 " overall)\n",
+         total, time_elapsed(start),
+         total * 1000000 / std::max<int64_t>(eval_time, 1),
+         total * 1000 / std::max<int64_t>(time_elapsed(start), 1));
 }
 
 Move uci_to_internal(const Position &position, std::string uci) {
@@ -189,29 +308,34 @@ void uci(ThreadInfo &thread_info, Position &position) {
     }
 
     if (command == "quit") {
-      thread_data.terminate = true;
-
-      reset_barrier.arrive_and_wait();
-      idle_barrier.arrive_and_wait();
-
-      for (int i = 0; i < thread_data.threads.size(); i++) {
-        if (thread_data.threads[i].joinable()) {
-          thread_data.threads[i].join();
-        }
-      }
+      stop_search(s);
+      thread_pool.resize(0);
       std::exit(0);
     }
 
     else if (command == "uci") {
-      printf("id name Patricia 4.0\n"
+      printf("id name Patricia 4.0 (%s)\n"
              "id author Adam Kulju\n"
              "option name Hash type spin default 32 min 1 max 131072\n"
              "option name Threads type spin default 1 min 1 max 1024\n"
+             "option name Ponder type check default false\n"
+             "option name Move Overhead type spin default 50 min 0 max 5000\n"
+             "option name TimeLog type string default <empty>\n"
              "option name MultiPV type spin default 1 min 1 max 255\n"
              "option name UCI_LimitStrength type check default false\n"
              "option name Skill_Level type spin default 21 min 1 max 21\n"
              "option name UCI_Elo type spin default 3001 min 500 max 3001\n"
-             "option name UCI_Chess960 type check default false\n");
+             "option name UCI_Chess960 type check default false\n"
+             "option name EvalFile type string default <internal>\n"
+             "option name EvalFileEndgame type string default <internal>\n"
+             "option name EvalFileSacrifice type string default <internal>\n"
+             "option name AllPhaseAccumulators type check default false\n"
+             "option name EvalCache type spin default 1 min 0 max 1024\n"
+             "option name SMPSkipDepths type check default false\n"
+             "option name SMPStagger type spin default 0 min 0 max 8\n"
+             "option name SMPQuietNoise type spin default 0 min 0 max 1024\n"
+             "option name ABDADA type check default false\n",
+             CpuLevelNames[g_cpu_level]);
 
       /*for (auto &param : params) {
         std::cout << "option name " << param.name << " type spin default "
@@ -226,6 +350,12 @@ void uci(ThreadInfo &thread_info, Position &position) {
       print_params_for_ob();
     }
 
+    else if (command == "debug") {
+      std::string value;
+      input_stream >> value;
+      thread_data.debug = value == "on";
+    }
+
     else if (command == "isready") {
       printf("readyok\n");
     }
@@ -235,7 +365,38 @@ void uci(ThreadInfo &thread_info, Position &position) {
       int value;
       input_stream >> command;
       input_stream >> name;
-      input_stream >> command;
+      // Option names can have spaces, e.g. Move Overhead
+      while (input_stream >> command && command != "value") {
+        name += " " + command;
+      }
+
+      if (name == "AllPhaseAccumulators") {
+        std::string value;
+        input_stream >> value;
+        g_all_phase_accumulators = value == "true";
+        continue;
+      }
+
+      if (name == "Ponder") {
+        // Nothing to set up: pondering is driven by go ponder.
+        std::string value;
+        input_stream >> value;
+        continue;
+      }
+
+      if (name == "SMPSkipDepths") {
+        std::string value;
+        input_stream >> value;
+        g_helper_skip_depths = value == "true";
+        continue;
+      }
+
+      if (name == "ABDADA") {
+        std::string value;
+        input_stream >> value;
+        g_abdada = value == "true";
+        continue;
+      }
 
       if (name == "UCI_LimitStrength" || name == "UCI_Chess960") {
         std::string value;
@@ -259,39 +420,41 @@ void uci(ThreadInfo &thread_info, Position &position) {
         continue;
       }
 
-      input_stream >> value;
-
-      if (name == "Hash") {
-        resize_TT(value);
+      if (name == "TimeLog") {
+        std::getline(input_stream >> std::ws, g_time_log);
+        if (g_time_log == "<empty>") {
+          g_time_log.clear();
+        }
+        continue;
       }
 
-      else if (name == "Threads") {
+      if (name == "EvalFile" || name == "EvalFileEndgame" ||
+          name == "EvalFileSacrifice") {
+        std::string path;
+        std::getline(input_stream >> std::ws, path);
 
-        thread_data.terminate = true;
+        int phase = name == "EvalFile"          ? PhaseTypes::Middlegame
+                    : name == "EvalFileEndgame" ? PhaseTypes::Endgame
+                                                : PhaseTypes::Sacrifice;
+        load_net(phase, path);
+        continue;
+      }
 
-        reset_barrier.arrive_and_wait();
-        idle_barrier.arrive_and_wait();
+      input_stream >> value;
 
-        for (int i = 0; i < thread_data.threads.size(); i++) {
-          if (thread_data.threads[i].joinable()) {
-            thread_data.threads[i].join();
-          }
-        }
+      if (name == "Hash") {
+        resize_TT(value);
+      }
 
-        thread_data.thread_infos.clear();
-        thread_data.threads.clear();
+      else if (name == "EvalCache") {
+        EvalCacheSize =
+            static_cast<uint64_t>(value) * 1024 * 1024 / sizeof(EvalCacheEntry);
+      }
 
-        thread_data.terminate = false;
+      else if (name == "Threads") {
+        // Threads that are kept keep their histories.
         thread_data.num_threads = value;
-
-        reset_barrier.reset(thread_data.num_threads);
-        idle_barrier.reset(thread_data.num_threads);
-        search_end_barrier.reset(thread_data.num_threads);
-
-        for (int i = 0; i < value - 1; i++) {
-          thread_data.thread_infos.emplace_back();
-          thread_data.threads.emplace_back(loop, i);
-        }
+        thread_pool.resize(value - 1);
       }
 
       else if (name == "UCI_Elo" && value != 3001) {
@@ -303,10 +466,22 @@ void uci(ThreadInfo &thread_info, Position &position) {
         thread_info.cp_loss = 200 - (to_elo / 13);
       }
 
+      else if (name == "Move Overhead") {
+        g_move_overhead = value;
+      }
+
       else if (name == "MultiPV") {
         thread_info.multipv = value;
       }
 
+      else if (name == "SMPStagger") {
+        g_helper_stagger = value;
+      }
+
+      else if (name == "SMPQuietNoise") {
+        g_helper_quiet_noise = value;
+      }
+
       else {
         for (auto &param : params) {
           if (name == param.name) {
@@ -320,19 +495,17 @@ void uci(ThreadInfo &thread_info, Position &position) {
     }
 
     else if (command == "stop") {
-      thread_data.stop = true;
+      stop_search(s);
+    }
 
-      if (s.joinable()) {
-        s.join();
-      }
+    else if (command == "ponderhit") {
+      thread_data.pondering = false;
+      thread_data.pondering.notify_all();
     }
 
     else if (command == "ucinewgame") {
-      thread_data.stop = true;
-
-      if (s.joinable()) {
-        s.join();
-      }
+      stop_search(s);
+      thread_pool.wait_for_idle();
 
       new_game(thread_info, TT);
       set_board(position, thread_info,
@@ -380,22 +553,23 @@ void uci(ThreadInfo &thread_info, Position &position) {
     else if (command == "go") {
       thread_info.start_time = std::chrono::steady_clock::now();
 
-      for (int i = 0; i < thread_data.thread_infos.size(); i++) {
-        while (thread_data.thread_infos[i].searching) {
-          ;
-        }
-      }
+      thread_pool.wait_for_idle();
       if (s.joinable()) {
         s.join();
       }
-      thread_info.max_nodes_searched = UINT64_MAX / 2;
-      thread_info.max_iter_depth = MaxSearchDepth;
+      reset_search_limits(thread_info);
 
-      int color = position.color, time = INT32_MAX, increment = 0;
+      int color = position.color, time = -1, increment = 0, movestogo = 0,
+          movetime = -1;
+      bool search_moves = false;
       std::string token;
       while (input_stream >> token) {
         if (token == "infinite") {
           ;
+        } else if (token == "ponder") {
+          thread_info.ponder = true;
+        } else if (token == "searchmoves") {
+          search_moves = true;
         } else if (token == "wtime" && color == Colors::White) {
           input_stream >> time;
         } else if (token == "btime" && color == Colors::Black) {
@@ -404,6 +578,8 @@ void uci(ThreadInfo &thread_info, Position &position) {
           input_stream >> increment;
         } else if (token == "binc" && color == Colors::Black) {
           input_stream >> increment;
+        } else if (token == "movestogo") {
+          input_stream >> movestogo;
         } else if (token == "nodes") {
           uint64_t nodes;
           input_stream >> nodes;
@@ -413,21 +589,28 @@ void uci(ThreadInfo &thread_info, Position &position) {
           input_stream >> depth;
           thread_info.max_iter_depth = depth;
         } else if (token == "movetime") {
-          int time;
-          input_stream >> time;
-          thread_info.max_time = time;
-          thread_info.opt_time = INT32_MAX / 2;
-          goto run;
+          input_stream >> movetime;
+        } else if (search_moves) {
+          // searchmoves takes every move up to the next keyword
+          if (Move move = uci_to_internal(position, token)) {
+            thread_info.search_moves.push_back(move);
+          }
         }
       }
 
-      // Calculate time allotted to search
-
-      time = std::max(2, time - 50);
-      thread_info.max_time = time / 2;
-      thread_info.opt_time = (time / 20 + increment * 8 / 10) * 6 / 10;
+      if (movetime >= 0) {
+        thread_info.max_time = movetime;
+      } else if (time >= 0) {
+        set_time_limits(thread_info, time, increment, movestogo);
+      }
 
-    run:
+      if (thread_info.ponder) {
+        thread_info.ponder_max_time = thread_info.max_time;
+        thread_info.ponder_opt_time = thread_info.opt_time;
+        thread_info.max_time = INT32_MAX / 2;
+        thread_info.opt_time = INT32_MAX / 2;
+      }
+      thread_data.pondering = thread_info.ponder;
       run_thread(position, thread_info, s);
     }
 
@@ -446,5 +629,31 @@ void uci(ThreadInfo &thread_info, Position &position) {
     else if (command == "bench") {
       bench(position, thread_info);
     }
+
+    else if (command == "simdtest") {
+      test_kernels();
+    }
+
+    else if (command == "smpbench") {
+      int depth = 10;
+      int threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+      input_stream >> depth >> threads;
+      smpbench(position, thread_info, bench_fens, depth, threads);
+    }
+
+    else if (command == "nnuebench") {
+      std::string format = "json";
+      input_stream >> format;
+      nnuebench(bench_fens, format);
+    }
+
+    else if (command == "evalbatch") {
+      std::string path, net = "middlegame";
+      input_stream >> path >> net;
+      evalbatch(path,
+                net == "endgame"     ? PhaseTypes::Endgame
+                : net == "sacrifice" ? PhaseTypes::Sacrifice
+                                     : PhaseTypes::Middlegame);
+    }
   }
 }
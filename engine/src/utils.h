@@ -3,6 +3,8 @@
 #include "nnue.h"
 #include "params.h"
 #include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <stdio.h>
 #include <thread>
@@ -12,27 +14,86 @@ using std::array;
 
 typedef unsigned __int128 uint128_t;
 
-struct ThreadInfo {
+// A direct-mapped cache of raw NNUE outputs. Every thread has its own, which
+// isn't carried over when a ThreadInfo is copied.
+struct EvalCache {
+  std::vector<EvalCacheEntry> entries;
+  uint64_t generation = UINT64_MAX; // g_net_generation it was filled with
+  uint64_t probes = 0;
+  uint64_t hits = 0;
+
+  EvalCache() {}
+  EvalCache(const EvalCache &) {}
+  EvalCache &operator=(const EvalCache &) { return *this; }
+};
+
+// What a search starts from: the game so far and the limits of the search.
+// The UCI commands set up the main thread's copy, which is handed to every
+// helper when a search starts (see set_search_root). Everything else in a
+// ThreadInfo belongs to its thread and is kept from one search to the next.
+struct SearchRoot {
+  Position position;
+  uint16_t game_ply; // how far we're into the game
+
+  std::chrono::steady_clock::time_point start_time; // Start time of the search
+
+  uint32_t max_time;
+  uint32_t opt_time;
+
+  // The clock the time limits came from (see set_time_limits), -1 for none.
+  int clock_time = -1;
+  int clock_increment = 0;
+  int movestogo = 0;
+
+  uint8_t max_iter_depth = MaxSearchDepth;
+  uint64_t max_nodes_searched = UINT64_MAX / 2;
+  uint64_t opt_nodes_searched = UINT64_MAX / 2;
+
+  uint16_t multipv = 1;
+  std::vector<Move> search_moves; // go searchmoves, empty for all moves
+
+  // go ponder: the search runs without a time limit until ponderhit, and
+  // then with these limits, counted from the ponderhit.
+  bool ponder = false;
+  uint32_t ponder_max_time;
+  uint32_t ponder_opt_time;
+
+  bool doing_datagen = false;
+  bool is_human = false;
+
+  uint8_t searches = 0; // age of this search's TT entries
+};
+
+void reset_search_limits(SearchRoot &root) {
+  // No limits, every root move. go, bench and smpbench start from here, so
+  // nothing a previous go set carries over.
+  root.max_time = INT32_MAX / 2, root.opt_time = INT32_MAX / 2;
+  root.max_iter_depth = MaxSearchDepth;
+  root.max_nodes_searched = UINT64_MAX / 2;
+  root.opt_nodes_searched = UINT64_MAX / 2;
+  root.search_moves.clear();
+  root.ponder = false;
+  root.clock_time = -1;
+}
+
+struct ThreadInfo : SearchRoot {
   uint16_t thread_id = 0; // ID of the thread
   std::array<GameHistory, GameSize>
       game_hist;       // all positions from earlier in the game
-  uint16_t game_ply;   // how far we're into the game
   uint16_t search_ply; // depth that we are in the search tree
 
   uint64_t nodes; // Total nodes searched so far this search
+  uint64_t unique_nodes; // nodes no thread had searched before, see smpbench
   std::vector<RootMoveInfo> root_moves;
 
-  std::chrono::steady_clock::time_point start_time; // Start time of the search
-
   int seldepth;
 
-  uint32_t max_time;
-  uint32_t opt_time;
   uint32_t original_opt;
 
   uint16_t time_checks;
 
   NNUE_State nnue_state;
+  EvalCache eval_cache;
 
   MultiArray<int16_t, 14, 64> HistoryScores;
   MultiArray<int16_t, 14, 64, 14, 64> ContHistScores;
@@ -42,34 +103,39 @@ struct ThreadInfo {
   std::array<Move, MaxSearchDepth + 1> KillerMoves;
 
   uint8_t current_iter;
-  uint16_t multipv = 1;
   uint16_t multipv_index;
 
   Move excluded_move;
   std::array<Move, ListSize> best_moves;
   std::array<int, ListSize> best_scores;
 
-  uint8_t max_iter_depth = MaxSearchDepth;
-  uint64_t max_nodes_searched = UINT64_MAX / 2;
-  uint64_t opt_nodes_searched = UINT64_MAX / 2;
+  // The last iteration this thread completed, for the best thread vote.
+  uint8_t completed_depth;
+  int completed_score;
+  std::array<Move, MaxSearchDepth> completed_pv;
 
-  bool doing_datagen = false;
   bool datagen_stop = false;
 
-  bool is_human = false;
   int cp_accum_loss = 0;
   int cp_loss = 0;
 
+  int quiet_noise; // see g_helper_quiet_noise
+  uint64_t rng;
+
   std::array<Move, MaxSearchDepth * MaxSearchDepth> pv;
   std::array<int, 5> pv_material;
 
-  Position position;
-
-  uint8_t searches = 0;
-  volatile bool searching = false;
   uint8_t phase;
 };
 
+void set_search_root(ThreadInfo &helper, const ThreadInfo &main) {
+  // Starts a helper's search from the main thread's root. Only the part of
+  // the game history that has been played is needed.
+
+  static_cast<SearchRoot &>(helper) = main;
+  std::copy_n(main.game_hist.begin(), main.game_ply, helper.game_hist.begin());
+}
+
 RootMoveInfo *find_root_move(ThreadInfo &thread_info, Move move) {
   for (int i = 0; i < thread_info.root_moves.size(); i++) {
     if (thread_info.root_moves[i].move == move)
@@ -79,12 +145,12 @@ RootMoveInfo *find_root_move(ThreadInfo &thread_info, Move move) {
 }
 
 struct ThreadData {
-  std::vector<ThreadInfo> thread_infos;
-  std::vector<std::thread> threads;
+  std::deque<ThreadInfo> thread_infos; // helpers, see ThreadPool
   int num_threads = 1;
   std::atomic<bool> stop = true;
-  std::atomic<bool> terminate = false;
+  std::atomic<bool> pondering = false; // cleared by ponderhit and stop
   bool is_frc = false;
+  bool debug = false;
 };
 
 ThreadData thread_data;
@@ -92,17 +158,116 @@ ThreadData thread_data;
 uint64_t TT_size = (1 << 20);
 std::vector<TTBucket> TT(TT_size);
 
-void new_game(ThreadInfo &thread_info, std::vector<TTBucket> &TT) {
-  // Reset TT and other thread_info values for a new game
+uint64_t EvalCacheSize = (1 << 20) / sizeof(EvalCacheEntry); // per thread
+
+// Lazy SMP helper diversification (the SMP* UCI options), all off by
+// default. Helpers can skip iterations in a per-thread pattern, start at
+// staggered depths, and add up to g_helper_quiet_noise to the ordering score
+// of each quiet move, which reorders quiets whose scores are (nearly) equal.
+bool g_helper_skip_depths = false;
+int g_helper_stagger = 0; // helpers start at depths 1 to 1 + g_helper_stagger
+int g_helper_quiet_noise = 0;
+
+// Set while smpbench runs: a bitset of the position keys searched by any
+// thread, which tells the nodes that were searched for the first time apart
+// from repeated work.
+constexpr uint64_t UniqueNodeBits = 1ull << 27;
+std::unique_ptr<std::atomic<uint64_t>[]> g_unique_nodes;
+
+void count_unique_node(ThreadInfo &thread_info, uint64_t key) {
+  const uint64_t bit = key & (UniqueNodeBits - 1);
+  const uint64_t mask = 1ull << (bit % 64);
+  if (!(g_unique_nodes[bit / 64].fetch_or(mask, std::memory_order_relaxed) &
+        mask)) {
+    thread_info.unique_nodes++;
+  }
+}
 
-  thread_info.game_ply = 6;
-  thread_info.thread_id = 0;
+// ABDADA (the ABDADA UCI option): the nodes being searched right now, with
+// their depth and the thread searching them, so that other threads can leave
+// those subtrees for the end of their move loop. Each entry packs the top 40
+// bits of the key, the depth (8 bits) and the thread ID + 1 (16 bits), and is
+// simply overwritten on collisions.
+constexpr int AbdadaMinDepth = 3;
+constexpr uint64_t AbdadaSize = 1 << 16;
+std::array<std::atomic<uint64_t>, AbdadaSize> g_abdada_table;
+bool g_abdada = false;
+
+uint64_t abdada_entry(uint64_t key, int depth, int thread_id) {
+  return (key & ~0xFFFFFFull) | uint64_t(depth & 0xFF) << 16 |
+         uint64_t(thread_id + 1);
+}
+
+bool abdada_busy(uint64_t key, int depth, int thread_id) {
+  // Whether another thread is searching the position at least this deep.
+  const uint64_t entry =
+      g_abdada_table[key & (AbdadaSize - 1)].load(std::memory_order_relaxed);
+  return entry && !((entry ^ key) >> 24) &&
+         (entry & 0xFFFF) != uint64_t(thread_id + 1) &&
+         int(entry >> 16 & 0xFF) >= depth;
+}
+
+// Marks a node as being searched for as long as the search stays in it.
+struct AbdadaMark {
+  std::atomic<uint64_t> *slot = nullptr;
+  uint64_t entry = 0;
+
+  AbdadaMark(uint64_t key, int depth, int thread_id) {
+    if (g_abdada && depth >= AbdadaMinDepth) {
+      slot = &g_abdada_table[key & (AbdadaSize - 1)];
+      entry = abdada_entry(key, std::min(depth, 255), thread_id);
+      slot->store(entry, std::memory_order_relaxed);
+    }
+  }
+
+  ~AbdadaMark() {
+    // Another thread may have taken the slot since.
+    if (slot) {
+      uint64_t expected = entry;
+      slot->compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+    }
+  }
+};
+
+uint64_t next_random(uint64_t &state) {
+  // xorshift64*
+  state ^= state >> 12, state ^= state << 25, state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Dull;
+}
+
+void prepare_eval_cache(ThreadInfo &thread_info) {
+  // Sizes the thread's eval cache to the EvalCache option and empties it if
+  // the nets changed since it was filled.
+
+  EvalCache &cache = thread_info.eval_cache;
+
+  if (cache.entries.size() != EvalCacheSize ||
+      cache.generation != g_net_generation) {
+    cache.entries.assign(EvalCacheSize, EvalCacheEntry{});
+    cache.generation = g_net_generation;
+  }
+  cache.probes = 0, cache.hits = 0;
+}
+
+void clear_histories(ThreadInfo &thread_info) {
   std::memset(&thread_info.HistoryScores, 0, sizeof(thread_info.HistoryScores));
   std::memset(&thread_info.ContHistScores, 0,
               sizeof(thread_info.ContHistScores));
   std::memset(&thread_info.CapHistScores, 0, sizeof(thread_info.CapHistScores));
   std::memset(&thread_info.PawnCorrHist, 0, sizeof(thread_info.PawnCorrHist));
   std::memset(&thread_info.NonPawnCorrHist, 0, sizeof(thread_info.NonPawnCorrHist));
+}
+
+void new_game(ThreadInfo &thread_info, std::vector<TTBucket> &TT) {
+  // Reset TT and other thread_info values for a new game. Helpers keep their
+  // histories between searches, so theirs are cleared as well.
+
+  thread_info.game_ply = 6;
+  thread_info.thread_id = 0;
+  clear_histories(thread_info);
+  for (ThreadInfo &helper : thread_data.thread_infos) {
+    clear_histories(helper);
+  }
   std::memset(&thread_info.game_hist, 0, sizeof(thread_info.game_hist));
   std::memset(&TT[0], 0, TT_size * sizeof(TT[0]));
   thread_info.searches = 0;
@@ -248,48 +413,175 @@ int64_t time_elapsed(std::chrono::steady_clock::time_point start_time) {
       .count();
 }
 
-// ty to Ciekce (https://github.com/Ciekce/Stormphrax) for providing this code
-// in a pinch to fix a critical bug.
+// Owns the helper threads of a Lazy SMP search. Helpers sleep on a condition
+// variable until a search starts and report back when they finish, and the
+// pool grows or shrinks without restarting the threads it keeps. The helpers'
+// ThreadInfos are thread_data.thread_infos, one per thread.
 
-class Barrier {
+class ThreadPool {
 public:
-  Barrier(int64_t expected) { reset(expected); }
+  using Job = void (*)(ThreadInfo &);
+
+  ~ThreadPool() { resize(0); }
+
+  size_t size() const { return m_threads.size(); }
+
+  void resize(size_t helpers) {
+    wait_for_idle();
+
+    if (helpers < m_threads.size()) {
+      {
+        std::lock_guard lock{m_mutex};
+        m_size = helpers;
+      }
+      m_wake.notify_all();
+
+      for (size_t i = helpers; i < m_threads.size(); i++) {
+        m_threads[i].join();
+      }
+      m_threads.resize(helpers);
+      thread_data.thread_infos.resize(helpers);
+      return;
+    }
+
+    std::lock_guard lock{m_mutex};
+    m_size = helpers;
+    thread_data.thread_infos.resize(helpers);
+    for (size_t i = m_threads.size(); i < helpers; i++) {
+      m_threads.emplace_back(&ThreadPool::worker, this, i, m_generation);
+    }
+  }
+
+  // Runs job on every helper's ThreadInfo.
+  void start(Job job) {
+    {
+      std::lock_guard lock{m_mutex};
+      m_job = job;
+      m_busy = m_size;
+      m_generation++;
+    }
+    m_wake.notify_all();
+  }
 
-  auto reset(int64_t expected) -> void {
+  void wait_for_idle() {
+    std::unique_lock lock{m_mutex};
+    m_idle.wait(lock, [this] { return m_busy == 0; });
+  }
 
-    m_total.store(expected, std::memory_order::seq_cst);
-    m_current.store(expected, std::memory_order::seq_cst);
+private:
+  void worker(size_t i, uint64_t generation) {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock lock{m_mutex};
+        m_wake.wait(lock, [&] { return i >= m_size || m_generation != generation; });
+        if (i >= m_size) {
+          return;
+        }
+        generation = m_generation;
+        job = m_job;
+      }
+
+      job(thread_data.thread_infos[i]);
+
+      std::lock_guard lock{m_mutex};
+      if (--m_busy == 0) {
+        m_idle.notify_all();
+      }
+    }
   }
 
-  auto arrive_and_wait() {
-    std::unique_lock lock{wait_mutex};
+  std::vector<std::thread> m_threads;
+  size_t m_size = 0;
+  size_t m_busy = 0;          // helpers that haven't finished the current job
+  uint64_t m_generation = 0;  // bumped by every start
+  Job m_job = nullptr;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+};
+
+ThreadPool thread_pool;
+
+// Enforces the hard time limit of a search from its own thread: once armed
+// with a deadline, it sets thread_data.stop when the deadline passes, so the
+// search threads never read the clock. It also lets the main thread wait out
+// a minimum think time without searching (hold_until), cut short by stop.
+
+class SearchTimer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  ~SearchTimer() {
+    {
+      std::lock_guard lock{m_mutex};
+      m_quit = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+  }
 
-    const auto current = --m_current;
+  void arm(Clock::time_point deadline) {
+    {
+      std::lock_guard lock{m_mutex};
+      if (!m_thread.joinable()) {
+        m_thread = std::thread(&SearchTimer::run, this);
+      }
+      m_deadline = deadline;
+      m_armed = true;
+    }
+    m_wake.notify_all();
+  }
 
-    if (current > 0) {
-      const auto phase = m_phase.load(std::memory_order::relaxed);
-      wait_signal.wait(lock, [this, phase] {
-        return (phase - m_phase.load(std::memory_order::acquire)) < 0;
-      });
-    } else {
-      const auto total = m_total.load(std::memory_order::acquire);
-      m_current.store(total, std::memory_order::release);
+  // Called at the start and end of every search.
+  void disarm() {
+    {
+      std::lock_guard lock{m_mutex};
+      m_armed = false;
+      m_released = false;
+    }
+    m_wake.notify_all();
+  }
 
-      m_phase++;
+  void hold_until(Clock::time_point deadline) {
+    std::unique_lock lock{m_mutex};
+    m_wake.wait_until(lock, deadline, [this] { return m_released; });
+  }
 
-      wait_signal.notify_all();
+  void release() {
+    {
+      std::lock_guard lock{m_mutex};
+      m_released = true;
     }
+    m_wake.notify_all();
   }
 
 private:
-  std::atomic<int64_t> m_total{};
-  std::atomic<int64_t> m_current{};
-  std::atomic<int64_t> m_phase{};
+  void run() {
+    std::unique_lock lock{m_mutex};
+    while (!m_quit) {
+      if (!m_armed) {
+        m_wake.wait(lock);
+      } else if (Clock::now() >= m_deadline) {
+        thread_data.stop = true;
+        m_armed = false;
+      } else {
+        m_wake.wait_until(lock, m_deadline);
+      }
+    }
+  }
+
+  std::thread m_thread;
+  Clock::time_point m_deadline;
+  bool m_armed = false;
+  bool m_released = false; // stop arrived, see hold_until
+  bool m_quit = false;
 
-  std::mutex wait_mutex{};
-  std::condition_variable wait_signal{};
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
 };
 
-Barrier reset_barrier{1};
-Barrier idle_barrier{1};
-Barrier search_end_barrier{1};
+SearchTimer search_timer;
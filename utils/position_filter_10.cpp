@@ -0,0 +1,81 @@
+// Keeps the positions whose NNUE score, from the side to move's point of view,
+// lies within [min, max]. Unlike the other filters this one links the engine
+// (build with `make filter` from engine/) and scores the file in batches.
+//
+// usage: filter <input> <output> [min] [max] [net file]
+
+#include "../engine/src/search.h"
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+
+int filter(const std::string input, const std::string &output, int min_score,
+           int max_score) {
+  constexpr size_t CHUNK_SIZE = EVAL_BATCH_SIZE * 512;
+
+  std::ofstream fout(output);
+  std::ifstream fin(input);
+  std::string line, kept;
+  std::vector<std::string> lines;
+  std::vector<Position> positions;
+  std::vector<int> scores;
+  int total_lines = 0, filtered_lines = 0;
+
+  auto flush = [&]() {
+    scores.resize(positions.size());
+    evaluate_batch(positions, PhaseTypes::Middlegame, scores);
+
+    kept.clear();
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (scores[i] >= min_score && scores[i] <= max_score) {
+        filtered_lines++;
+        kept += lines[i] + "\n";
+      }
+    }
+    fout << kept;
+
+    lines.clear(), positions.clear();
+  };
+
+  while (std::getline(fin, line)) {
+    if (line.empty()) { // blank lines aren't positions
+      continue;
+    }
+    total_lines++;
+    positions.emplace_back();
+    set_board_pieces(positions.back(), line);
+    lines.push_back(line);
+
+    if (positions.size() == CHUNK_SIZE) {
+      flush();
+    }
+  }
+  flush();
+
+  fout.close();
+  fin.close();
+  printf("%i positions read in, %i filtered\n", total_lines, filtered_lines);
+  return total_lines;
+}
+
+int main(int argc, char *argv[]) {
+  init_bbs();
+
+  if (argc < 3) {
+    printf("usage: %s <input> <output> [min] [max] [net file]\n", argv[0]);
+    return 1;
+  }
+
+  int min_score = argc > 3 ? atoi(argv[3]) : -100;
+  int max_score = argc > 4 ? atoi(argv[4]) : 100;
+  if (argc > 5 && !load_net(PhaseTypes::Middlegame, argv[5])) {
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int positions = filter(argv[1], argv[2], min_score, max_score);
+  int64_t elapsed = std::max<int64_t>(time_elapsed(start), 1);
+  printf("%f seconds, %" PRIi64 " positions/s\n", elapsed / 1000.0,
+         positions * 1000 / elapsed);
+  return 0;
+}